@@ -0,0 +1,95 @@
+#include "batch_pool.h"
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+batch_pool::batch_pool(unsigned threads) : stopping(false) {
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd == -1) {
+        throw runtime_error("Failed to create batch eventfd");
+    }
+    for (unsigned i = 0; i < max(threads, 1u); i++) {
+        workers.emplace_back(&batch_pool::worker, this);
+    }
+}
+
+batch_pool::~batch_pool() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (thread& t : workers) {
+        t.join();
+    }
+    close(efd);
+}
+
+int batch_pool::event_fd() {
+    return efd;
+}
+
+unsigned batch_pool::size() {
+    return workers.size();
+}
+
+void batch_pool::submit(shared_ptr<batch_request> request) {
+    {
+        lock_guard<mutex> guard(lock);
+        pending.push_back(move(request));
+    }
+    ready.notify_all();
+}
+
+// Take every finished item; called by the shard when the eventfd fires
+void batch_pool::collect(vector<batch_item>& items) {
+    uint64_t count;
+    if (read(efd, &count, sizeof(count)) == -1) {
+        // Nothing signalled; the queue may still hold items
+    }
+    lock_guard<mutex> guard(lock);
+    items.swap(done);
+}
+
+void batch_pool::worker() {
+    // Preallocated once; run_decoded() resets it for every item
+    y86_instruction_handler handler;
+
+    while (true) {
+        shared_ptr<batch_request> request;
+        size_t index;
+        {
+            unique_lock<mutex> guard(lock);
+            ready.wait(guard, [this]() { return stopping || !pending.empty(); });
+            if (stopping) {
+                return;
+            }
+            request = pending.front();
+            index = request->next++;
+            if (request->next >= request->inits.size()) {
+                pending.pop_front();
+            }
+        }
+
+        batch_item item{request, index, {"", STOP_NONE, 0, ""}, chrono::nanoseconds(0)};
+        if (!request->limits.cancelled) {
+            auto start = chrono::steady_clock::now();
+            item.result = run_decoded(handler, *request->decoded, request->inits[index],
+                                      request->max_steps, &request->limits);
+            item.elapsed = chrono::steady_clock::now() - start;
+        }
+
+        bool wake;
+        {
+            lock_guard<mutex> guard(lock);
+            wake = done.empty();
+            done.push_back(move(item));
+        }
+        if (wake) {
+            uint64_t one = 1;
+            if (write(efd, &one, sizeof(one)) == -1) {
+                // Counter saturated; the shard has a wakeup pending anyway
+            }
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef BATCH_POOL_H // Include guard
+#define BATCH_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "y86_instruction_handler.h"
+#include "y86_batch.h"
+
+using namespace std;
+
+// One submitted batch: a program decoded once and the initial states to
+// run it from. Only the shard thread touches the counters below `limits`.
+struct batch_request {
+    shared_ptr<y86_instruction_handler> decoded;
+    vector<string> inits;
+    uint64_t max_steps;
+    size_t next = 0;                    // Next initial state to claim, under the pool lock
+    run_limits limits;                  // The session's budgets; cancelled when it goes away
+    size_t completed = 0;
+    uint64_t instructions = 0;
+    chrono::steady_clock::time_point start;
+};
+
+struct batch_item {
+    shared_ptr<batch_request> request;
+    size_t index;
+    batch_result result;
+    chrono::nanoseconds elapsed;        // Worker time, charged to the session
+};
+
+// Worker threads for batch requests, each with its own handler that is
+// reset and reused for every item. Finished items are queued for the shard
+// thread, which is woken through an eventfd in its epoll set whenever the
+// queue goes from empty to non-empty.
+class batch_pool {
+    private:
+        vector<thread> workers;
+        mutex lock;
+        condition_variable ready;
+        deque<shared_ptr<batch_request>> pending;
+        vector<batch_item> done;
+        int efd;
+        bool stopping;
+
+        void worker();
+
+    public:
+        batch_pool(unsigned threads);
+        ~batch_pool();
+        batch_pool(const batch_pool&) = delete;
+        batch_pool& operator=(const batch_pool&) = delete;
+
+        int event_fd();
+        unsigned size();
+        void submit(shared_ptr<batch_request> request);
+        void collect(vector<batch_item>& items);
+};
+
+#endif // BATCH_POOL_H
@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "y86_instruction_handler.h"
+#include "program_cache.h"
+#include "perf_counters.h"
+#include "shm_ring.h"
+
+using namespace std;
+
+// ALU-heavy loop: seven flag-setting ALU ops per iteration, and only the
+// closing jne reads the condition codes
+static string alu_program(uint64_t iterations) {
+    return "load irmovq " + to_string(iterations) + " r0; "
+           "irmovq 1 r1; "
+           "irmovq 3 r2; "
+           "addq r2 r3; "
+           "xorq r3 r5; "
+           "andq r2 r6; "
+           "mulq r2 r7; "
+           "addq r1 r8; "
+           "subq r1 r9; "
+           "subq r1 r0; "
+           "jne 30; "
+           "halt";
+}
+
+static void report_counters(perf_counters& counters, const perf_sample& sample, uint64_t emulated) {
+    if (!counters.available()) {
+        cout << "perf: counters unavailable (" << counters.unavailable_reason() << ")" << endl;
+        return;
+    }
+    cout << perf_counters::report(sample, emulated) << endl;
+}
+
+static int bench_alu(uint64_t iterations) {
+    string load = alu_program(iterations);
+    string run = "run-until";
+    double best = 0;
+    perf_counters counters;
+    perf_sample best_sample = counters.read();
+
+    // Report the fastest of several runs to keep scheduler noise out
+    for (int rep = 0; rep < 5; rep++) {
+        y86_instruction_handler handler;
+        string reply = handler.handle_instruction(load);
+        if (reply.rfind("Program Loaded", 0) != 0) {
+            cerr << "Failed to load program: " << reply << endl;
+            return 1;
+        }
+
+        counters.reset();
+        auto start = chrono::steady_clock::now();
+        counters.start();
+        reply = handler.handle_instruction(run);
+        counters.stop();
+        auto end = chrono::steady_clock::now();
+
+        if (reply.rfind("Stopped: Halt", 0) != 0) {
+            cerr << "Unexpected stop: " << reply << endl;
+            return 1;
+        }
+        double secs = chrono::duration<double>(end - start).count();
+        if (rep == 0 || secs < best) {
+            best = secs;
+            best_sample = counters.read();
+        }
+    }
+
+    uint64_t executed = iterations * 8 + 4;
+    cout << "alu: " << executed << " instructions in " << best << " s, "
+         << (executed / best) / 1e6 << " M inst/s, "
+         << (best * 1e9) / executed << " ns/inst" << endl;
+    report_counters(counters, best_sample, executed);
+    return 0;
+}
+
+// Per-request cost: single-step instructions through handle_instruction,
+// text parsing included, as the server does for every plain request
+static int bench_step(uint64_t steps) {
+    static const char* body[] = {
+        "irmovq 3 r2", "addq r2 r3", "xorq r3 r5", "andq r2 r6",
+        "rmmovq r3 64(r4)", "mrmovq 64(r4) r7", "subq r1 r9", "nop"
+    };
+    y86_instruction_handler handler;
+    vector<string> requests;
+    for (uint64_t i = 0; i < steps; i++) {
+        requests.push_back(body[i % (sizeof(body) / sizeof(body[0]))]);
+    }
+
+    perf_counters counters;
+    auto start = chrono::steady_clock::now();
+    for (string& request : requests) {
+        counters.start();
+        string reply = handler.handle_instruction(request);
+        counters.stop();
+        if (reply != "Instruction Executed") {
+            cerr << "Unexpected reply: " << reply << endl;
+            return 1;
+        }
+    }
+    auto end = chrono::steady_clock::now();
+
+    double secs = chrono::duration<double>(end - start).count();
+    cout << "step: " << steps << " requests in " << secs << " s, "
+         << (secs * 1e9) / steps << " ns/request" << endl;
+    report_counters(counters, counters.read(), steps);
+    return 0;
+}
+
+// Session start cost: load the same program into fresh sessions, with and
+// without the shared program cache
+static int bench_load(uint64_t sessions) {
+    string load = alu_program(1000);
+    program_cache shared(1 << 20, 64 << 10);
+
+    for (int cached = 0; cached < 2; cached++) {
+        y86_instruction_handler::set_program_cache(cached ? &shared : nullptr);
+        auto start = chrono::steady_clock::now();
+        for (uint64_t i = 0; i < sessions; i++) {
+            y86_instruction_handler handler;
+            string reply = handler.handle_instruction(load);
+            if (reply.rfind("Program Loaded", 0) != 0) {
+                cerr << "Failed to load program: " << reply << endl;
+                return 1;
+            }
+        }
+        auto end = chrono::steady_clock::now();
+        double secs = chrono::duration<double>(end - start).count();
+        cout << "load (" << (cached ? "cached" : "uncached") << "): " << sessions
+             << " sessions in " << secs << " s, " << (secs * 1e9) / sessions << " ns/session" << endl;
+    }
+    y86_instruction_handler::set_program_cache(nullptr);
+    return 0;
+}
+
+// One connect/request/close cycle against a running server
+static bool connect_once(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return false;
+    }
+    sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port);
+    serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bool ok = false;
+    char buffer[256];
+    if (connect(sock, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == 0 &&
+        send(sock, "nop", 3, 0) == 3 && recv(sock, buffer, sizeof(buffer), 0) > 0) {
+        ok = true;
+    }
+    close(sock);
+    return ok;
+}
+
+// Connection storm: many threads opening short-lived sessions as fast as
+// they can. Run the server with different --shards to compare accept rates.
+static int bench_accept(uint64_t connections, int port) {
+    unsigned threads = max(4u, thread::hardware_concurrency() * 4);
+    atomic<uint64_t> next(0), failed(0);
+    vector<thread> workers;
+
+    auto start = chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            while (next.fetch_add(1) < connections) {
+                if (!connect_once(port)) {
+                    failed++;
+                }
+            }
+        });
+    }
+    for (thread& w : workers) {
+        w.join();
+    }
+    auto end = chrono::steady_clock::now();
+
+    double secs = chrono::duration<double>(end - start).count();
+    cout << "accept: " << connections << " connections (" << failed.load()
+         << " failed) from " << threads << " threads in " << secs << " s, "
+         << connections / secs << " conn/s" << endl;
+    return failed.load() == connections;
+}
+
+// Single-step round trips on one session over TCP, a Unix-domain socket or
+// the shared memory rings. Start the server with --unix for the local ones.
+static int bench_rtt(const string& transport, uint64_t requests, const string& target) {
+    int sock;
+    if (transport == "tcp") {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(atoi(target.c_str()));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(sock, (struct sockaddr*)&address, sizeof(address)) == -1) {
+            cerr << "Failed to connect." << endl;
+            return 1;
+        }
+    } else {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, target.c_str(), sizeof(address.sun_path) - 1);
+        if (connect(sock, (struct sockaddr*)&address, sizeof(address)) == -1) {
+            cerr << "Failed to connect." << endl;
+            return 1;
+        }
+    }
+
+    unique_ptr<shm_channel> ring;
+    if (transport == "shm") {
+        try {
+            ring = request_ring(sock, 65536);
+        } catch (const exception& e) {
+            cerr << "Failed to set up ring: " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    string request = "nop", reply;
+    char buffer[256];
+    vector<double> samples;
+    samples.reserve(requests);
+    for (uint64_t i = 0; i < requests; i++) {
+        auto start = chrono::steady_clock::now();
+        bool ok;
+        if (ring) {
+            ok = ring->send_message(request) && ring->recv_message(reply);
+        } else {
+            ok = send(sock, request.data(), request.size(), 0) == (ssize_t) request.size() &&
+                 recv(sock, buffer, sizeof(buffer), 0) > 0;
+        }
+        auto end = chrono::steady_clock::now();
+        if (!ok) {
+            cerr << "Request failed." << endl;
+            return 1;
+        }
+        samples.push_back(chrono::duration<double, micro>(end - start).count());
+    }
+    ring.reset();
+    close(sock);
+
+    sort(samples.begin(), samples.end());
+    double total = 0;
+    for (double us : samples) {
+        total += us;
+    }
+    cout << "rtt (" << transport << "): " << requests << " requests, mean "
+         << total / requests << " us, p50 " << samples[requests / 2] << " us, p99 "
+         << samples[requests * 99 / 100] << " us" << endl;
+    return 0;
+}
+
+static int usage(const char* prog) {
+    cerr << "Usage: " << prog << " alu [iterations]" << endl;
+    cerr << "       " << prog << " step [requests]" << endl;
+    cerr << "       " << prog << " load [sessions]" << endl;
+    cerr << "       " << prog << " accept [connections] [port]" << endl;
+    cerr << "       " << prog << " rtt tcp|unix|shm [requests] [port|path]" << endl;
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    string mode = argc > 1 ? argv[1] : "alu";
+
+    if (mode == "rtt" && argc > 2) {
+        string transport = argv[2];
+        uint64_t requests = argc > 3 ? stoull(argv[3]) : 100000;
+        string target = argc > 4 ? argv[4] : (transport == "tcp" ? "8080" : "/tmp/y86.sock");
+        if (requests && (transport == "tcp" || transport == "unix" || transport == "shm")) {
+            return bench_rtt(transport, requests, target);
+        }
+    }
+    if (mode == "rtt") {
+        return usage(argv[0]);
+    }
+    uint64_t iterations = argc > 2 ? stoull(argv[2]) : 2000000;
+
+    if (mode == "alu") {
+        return bench_alu(iterations);
+    }
+    if (mode == "step") {
+        return bench_step(argc > 2 ? iterations : 1000000);
+    }
+    if (mode == "load") {
+        return bench_load(argc > 2 ? iterations : 100000);
+    }
+    if (mode == "accept") {
+        int port = argc > 3 ? atoi(argv[3]) : 8080;
+        return bench_accept(argc > 2 ? iterations : 20000, port);
+    }
+    return usage(argv[0]);
+}
@@ -1,37 +1,181 @@
 #include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include "shm_ring.h"
 
 using namespace std;
 
-int main() {
-    // Creating socket
-    int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (clientSocket == -1) {
+// Send the whole buffer, retrying short writes
+static bool send_all(int sock, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(sock, data, len, 0);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+// memwrite <addr> <file>: build a request streaming the file's bytes into
+// session memory
+static bool build_memwrite(istringstream& args, string& request) {
+    string addr, path;
+    args >> addr >> path;
+    ifstream file(path, ios::binary);
+    if (!file) {
+        cerr << "Cannot open " << path << endl;
+        return false;
+    }
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    request = "memwrite " + addr + " " + to_string(data.size()) + "\n" + data;
+    return true;
+}
+
+// Format a memread reply's raw bytes as a hex dump
+static string format_memread(const string& reply) {
+    size_t eol = reply.find('\n');
+    if (reply.rfind("Memory Read: ", 0) != 0 || eol == string::npos) {
+        return reply;
+    }
+    stringstream ss;
+    ss << reply.substr(0, eol);
+    for (size_t i = 0; eol + 1 + i < reply.size(); i++) {
+        if (i % 16 == 0) {
+            ss << "\n" << hex << setw(8) << setfill('0') << i << ":";
+        }
+        ss << " " << hex << setw(2) << setfill('0') << (int) (uint8_t) reply[eol + 1 + i];
+    }
+    return ss.str();
+}
+
+// Receive a memread reply: a header line followed by the raw bytes
+static bool recv_memread(int sock, string& reply) {
+    char buffer[65536];
+    size_t eol;
+    while ((eol = reply.find('\n')) == string::npos) {
+        int n = recv(sock, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            return false;
+        }
+        reply.append(buffer, n);
+        // Errors are a single line with no payload
+        if (reply.rfind("Memory Read: ", 0) != 0) {
+            return true;
+        }
+    }
+    size_t len = stoull(reply.substr(13));
+    while (reply.size() < eol + 1 + len) {
+        int n = recv(sock, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            return false;
+        }
+        reply.append(buffer, n);
+    }
+    reply = format_memread(reply);
+    return true;
+}
+
+static int connect_tcp(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
         cerr << "Failed to create socket." << endl;
-        return 1;
+        return -1;
     }
 
     // Specifying address
     sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
     serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(8080);
+    serverAddress.sin_port = htons(port);
     serverAddress.sin_addr.s_addr = INADDR_ANY; // Connect to localhost; change if needed.
 
-    // Sending connection request
-    if (connect(clientSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == -1) {
+    if (connect(sock, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == -1) {
         cerr << "Failed to connect to the server." << endl;
-        close(clientSocket); // Clean up
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int connect_unix(const string& path) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        cerr << "Failed to create socket." << endl;
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*)&address, sizeof(address)) == -1) {
+        cerr << "Failed to connect to " << path << "." << endl;
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void usage(const char* prog) {
+    cerr << "Usage: " << prog << " [--port N | --unix PATH [--shm]]" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    int port = 8080;
+    string unix_path;
+    bool use_shm = false;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (arg == "--unix" && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else if (arg == "--shm") {
+            use_shm = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (use_shm && unix_path.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // A Unix-domain socket for clients on the same host, TCP otherwise
+    int clientSocket = unix_path.empty() ? connect_tcp(port) : connect_unix(unix_path);
+    if (clientSocket == -1) {
         return 1;
     }
 
+    // Requests and replies then bypass the socket entirely
+    unique_ptr<shm_channel> ring;
+    if (use_shm) {
+        try {
+            ring = request_ring(clientSocket, 1 << 20);
+        } catch (const exception& e) {
+            cerr << "Failed to set up shared memory transport: " << e.what() << endl;
+            close(clientSocket);
+            return 1;
+        }
+    }
+
     cout << "Connected to the server." << endl;
 
     // Loop to send Y86 instructions until "quit" or "q" is sent
     string message;
-    char buffer[1024] = {0};
+    char buffer[65536] = {0};
 
     while (true) {
         cout << "Enter Y86 instruction (or 'quit' to exit): ";
@@ -43,29 +187,54 @@ int main() {
             break;
         }
 
+        istringstream args(message);
+        string command;
+        args >> command;
+
+        if (command == "memwrite" && !build_memwrite(args, message)) {
+            continue;
+        }
+
+        string reply;
+        if (ring) {
+            if (!ring->send_message(message) || !ring->recv_message(reply)) {
+                cerr << "Server disconnected." << endl;
+                break;
+            }
+            if (command == "memread") {
+                reply = format_memread(reply);
+            }
+            cout << "Server response: " << reply << endl;
+            continue;
+        }
+
         // Sending data to the server
-        ssize_t bytesSent = send(clientSocket, message.c_str(), message.size(), 0);
-        if (bytesSent < 0) {
+        if (!send_all(clientSocket, message.c_str(), message.size())) {
             cerr << "Error sending message to server." << endl;
             break;
         }
 
         // Receiving the server's response
-        memset(buffer, 0, sizeof(buffer)); // Clear buffer before receiving
-        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (bytesReceived <= 0) {
-            cerr << "Error receiving message from server or server disconnected." << endl;
-            break;
+        if (command == "memread") {
+            if (!recv_memread(clientSocket, reply)) {
+                cerr << "Error receiving message from server or server disconnected." << endl;
+                break;
+            }
+        } else {
+            int bytesReceived = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+            if (bytesReceived <= 0) {
+                cerr << "Error receiving message from server or server disconnected." << endl;
+                break;
+            }
+            reply.assign(buffer, bytesReceived);
         }
 
-        // Ensure the buffer is null-terminated
-        buffer[bytesReceived] = '\0';
-
         // Print the server's response
-        cout << "Server response: " << buffer << endl;
+        cout << "Server response: " << reply << endl;
     }
 
     // Closing the socket
+    ring.reset();
     close(clientSocket);
     cout << "Client closed." << endl;
 
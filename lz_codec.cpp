@@ -0,0 +1,128 @@
+#include "lz_codec.h"
+#include <cstring>
+#include <vector>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t hash4(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static void put_length(string& out, size_t len) {
+    while (len >= 255) {
+        out.push_back((char) 255);
+        len -= 255;
+    }
+    out.push_back((char) len);
+}
+
+static void put_sequence(string& out, const uint8_t* literals, size_t lit_len, size_t match_len, size_t offset) {
+    size_t m = match_len ? match_len - MIN_MATCH : 0;
+    uint8_t token = (min(lit_len, (size_t) 15) << 4) | min(m, (size_t) 15);
+    out.push_back((char) token);
+    if (lit_len >= 15) {
+        put_length(out, lit_len - 15);
+    }
+    out.append((const char*) literals, lit_len);
+    if (!match_len) {
+        return;
+    }
+    out.push_back((char) (offset & 0xff));
+    out.push_back((char) (offset >> 8));
+    if (m >= 15) {
+        put_length(out, m - 15);
+    }
+}
+
+string lz_compress(const void* data, size_t len) {
+    const uint8_t* src = (const uint8_t*) data;
+    uint32_t original = len;
+    string out((const char*) &original, sizeof(original));
+    vector<int64_t> table(1 << HASH_BITS, -1);
+    size_t anchor = 0, pos = 0;
+
+    // The last bytes are always literals so matches never read past the end
+    while (len >= MIN_MATCH && pos + MIN_MATCH <= len) {
+        uint32_t h = hash4(src + pos);
+        int64_t candidate = table[h];
+        table[h] = pos;
+        if (candidate < 0 || pos - candidate > MAX_OFFSET ||
+            memcmp(src + candidate, src + pos, MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+        size_t match = MIN_MATCH;
+        while (pos + match < len && src[candidate + match] == src[pos + match]) {
+            match++;
+        }
+        put_sequence(out, src + anchor, pos - anchor, match, pos - candidate);
+        pos += match;
+        anchor = pos;
+    }
+    put_sequence(out, src + anchor, len - anchor, 0, 0);
+    return out;
+}
+
+static bool get_length(const uint8_t*& p, const uint8_t* end, size_t& len) {
+    uint8_t b;
+    do {
+        if (p >= end) {
+            return false;
+        }
+        b = *p++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool lz_decompress(const string& in, string& out) {
+    uint32_t original;
+    if (in.size() < sizeof(original)) {
+        return false;
+    }
+    memcpy(&original, in.data(), sizeof(original));
+    const uint8_t* p = (const uint8_t*) in.data() + sizeof(original);
+    const uint8_t* end = (const uint8_t*) in.data() + in.size();
+    out.assign(original, '\0');
+    size_t pos = 0;
+
+    while (p < end) {
+        uint8_t token = *p++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !get_length(p, end, lit_len)) {
+            return false;
+        }
+        if ((size_t) (end - p) < lit_len || original - pos < lit_len) {
+            return false;
+        }
+        memcpy(&out[pos], p, lit_len);
+        p += lit_len;
+        pos += lit_len;
+        if (p == end) {
+            break; // Last sequence
+        }
+
+        if (end - p < 2) {
+            return false;
+        }
+        size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+        size_t match = token & 15;
+        if (match == 15 && !get_length(p, end, match)) {
+            return false;
+        }
+        match += MIN_MATCH;
+        if (offset == 0 || offset > pos || original - pos < match) {
+            return false;
+        }
+        // Byte by byte: an overlapping match repeats the bytes it just wrote
+        for (size_t i = 0; i < match; i++, pos++) {
+            out[pos] = out[pos - offset];
+        }
+    }
+    return pos == original;
+}
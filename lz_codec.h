@@ -0,0 +1,23 @@
+#ifndef LZ_CODEC_H // Include guard
+#define LZ_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Small LZ77 codec for hibernated session state. Compression is a single
+// greedy pass with a hash table of recent 4-byte sequences; long runs of
+// zeros, as in untouched Y86 memory, collapse into one overlapping match.
+//
+// Format: original length (32 bits), then sequences of a token byte (high
+// nibble literal count, low nibble match length - 4; 15 means more length
+// bytes follow, each added until one is below 255), the literals, and a
+// 16-bit match offset. The last sequence has literals only.
+string lz_compress(const void* data, size_t len);
+
+// Returns false if the input is corrupt
+bool lz_decompress(const string& in, string& out);
+
+#endif // LZ_CODEC_H
@@ -0,0 +1,153 @@
+#include "perf_counters.h"
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <linux/perf_event.h>
+#include <sstream>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char* EVENT_NAMES[PERF_EVENT_COUNT] = {
+    "cycles", "instructions", "branch-misses", "L1d-misses"
+};
+
+static int open_event(uint32_t type, uint64_t config, int group) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group == -1;    // The leader starts the whole group
+    attr.exclude_kernel = 1;        // Allowed with perf_event_paranoid <= 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                       PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+perf_counters::perf_counters() : leader(-1) {
+    static const uint32_t types[PERF_EVENT_COUNT] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+    };
+    static const uint64_t configs[PERF_EVENT_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        fds[i] = open_event(types[i], configs[i], leader);
+        if (fds[i] == -1) {
+            if (error.empty()) {
+                error = string(EVENT_NAMES[i]) + ": " + strerror(errno);
+            }
+        } else if (leader == -1) {
+            leader = fds[i];
+        }
+    }
+}
+
+perf_counters::~perf_counters() {
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+}
+
+bool perf_counters::available() {
+    return leader != -1;
+}
+
+const string& perf_counters::unavailable_reason() {
+    return error;
+}
+
+void perf_counters::start() {
+    if (leader != -1) {
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+void perf_counters::stop() {
+    if (leader != -1) {
+        ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+void perf_counters::reset() {
+    if (leader != -1) {
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+perf_sample perf_counters::read() {
+    perf_sample sample;
+    memset(&sample, 0, sizeof(sample));
+    if (leader == -1) {
+        return sample;
+    }
+
+    // Group layout: nr, time_enabled, time_running, then {value, id} pairs
+    uint64_t buf[3 + 2 * PERF_EVENT_COUNT];
+    if (::read(leader, buf, sizeof(buf)) < (ssize_t) (3 * sizeof(uint64_t))) {
+        return sample;
+    }
+    uint64_t nr = buf[0], enabled = buf[1], running = buf[2];
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        uint64_t id;
+        if (fds[i] == -1 || ioctl(fds[i], PERF_EVENT_IOC_ID, &id) == -1) {
+            continue;
+        }
+        for (uint64_t j = 0; j < nr && j < PERF_EVENT_COUNT; j++) {
+            if (buf[4 + 2 * j] == id) {
+                uint64_t value = buf[3 + 2 * j];
+                if (running && running < enabled) {
+                    value = (uint64_t) ((double) value * enabled / running);
+                }
+                sample.value[i] = value;
+                sample.valid[i] = true;
+            }
+        }
+    }
+    return sample;
+}
+
+// Raw totals, IPC, and per-emulated-instruction rates when a count is given
+string perf_counters::report(const perf_sample& sample, uint64_t emulated) {
+    stringstream ss;
+    bool first = true;
+
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        if (!sample.valid[i]) {
+            continue;
+        }
+        ss << (first ? "" : ", ") << EVENT_NAMES[i] << " " << sample.value[i];
+        first = false;
+    }
+    if (first) {
+        return "perf: counters unavailable";
+    }
+    ss << fixed << setprecision(3);
+    if (sample.valid[PERF_CYCLES] && sample.valid[PERF_INSTRUCTIONS] && sample.value[PERF_CYCLES]) {
+        ss << ", IPC " << (double) sample.value[PERF_INSTRUCTIONS] / sample.value[PERF_CYCLES];
+    }
+    if (emulated) {
+        if (sample.valid[PERF_CYCLES]) {
+            ss << ", cycles/inst " << (double) sample.value[PERF_CYCLES] / emulated;
+        }
+        if (sample.valid[PERF_INSTRUCTIONS]) {
+            ss << ", host insts/inst " << (double) sample.value[PERF_INSTRUCTIONS] / emulated;
+        }
+        if (sample.valid[PERF_BRANCH_MISSES]) {
+            ss << ", mispredicts/inst " << (double) sample.value[PERF_BRANCH_MISSES] / emulated;
+        }
+        if (sample.valid[PERF_L1D_MISSES]) {
+            ss << ", L1d misses/inst " << (double) sample.value[PERF_L1D_MISSES] / emulated;
+        }
+    }
+    return "perf: " + ss.str();
+}
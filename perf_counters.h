@@ -0,0 +1,49 @@
+#ifndef PERF_COUNTERS_H // Include guard
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+enum perf_event_t {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_EVENT_COUNT
+};
+
+// Counter totals, scaled up if the kernel had to multiplex the group
+struct perf_sample {
+    uint64_t value[PERF_EVENT_COUNT];
+    bool valid[PERF_EVENT_COUNT];
+};
+
+// User-space hardware counters for the calling thread, read through
+// perf_event_open. The events form one group so they cover the same
+// regions; counting only happens between start() and stop(), so totals
+// accumulate over many short regions. Events the CPU or kernel does not
+// offer are left out, and with none at all every call is a no-op.
+class perf_counters {
+    private:
+        int fds[PERF_EVENT_COUNT];
+        int leader;
+        string error;
+
+    public:
+        perf_counters();
+        ~perf_counters();
+        perf_counters(const perf_counters&) = delete;
+        perf_counters& operator=(const perf_counters&) = delete;
+
+        bool available();
+        const string& unavailable_reason();
+        void start();
+        void stop();
+        void reset();
+        perf_sample read();
+        static string report(const perf_sample& sample, uint64_t emulated);
+};
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,178 @@
+#include "program_cache.h"
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+
+struct cache_header {
+    pthread_mutex_t mutex;
+    uint64_t tick;          // LRU clock, bumped on every hit and insert
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+// One cached program. Its slot holds the program text (to rule out hash
+// collisions), then the decoded records, then the PC offset table.
+struct cache_entry {
+    uint64_t hash;
+    uint64_t last_used;     // 0 for an empty slot
+    uint32_t text_len;
+    uint32_t inst_count;
+    uint32_t offset_count;
+};
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t) 7;
+}
+
+uint64_t fnv1a_hash(const void* data, size_t len, uint64_t hash) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+program_cache::program_cache(size_t bytes, size_t slot_size) {
+    // Every slot must start aligned for the decoded records copied into it
+    static_assert(alignof(y86_inst) <= 8, "Cache slots are 8-byte aligned");
+    slot_size = align8(slot_size);
+    if (slot_size < 64 || bytes < slot_size) {
+        throw invalid_argument("Program cache too small");
+    }
+    uint32_t count = bytes / slot_size;
+    map_size = sizeof(cache_header) + align8(count * sizeof(cache_entry)) + count * slot_size;
+
+    void* mem = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw runtime_error("Failed to map program cache");
+    }
+    header = (cache_header*) mem;
+    entries = (cache_entry*) (header + 1);
+    slots = (uint8_t*) entries + align8(count * sizeof(cache_entry));
+
+    // Anonymous mappings start zeroed, so every slot starts empty
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    header->slot_count = count;
+    header->slot_size = slot_size;
+}
+
+program_cache::~program_cache() {
+    munmap(header, map_size);
+}
+
+void program_cache::lock() {
+    if (pthread_mutex_lock(&header->mutex) == EOWNERDEAD) {
+        // The previous owner died mid-update; drop whatever it was touching
+        for (uint32_t i = 0; i < header->slot_count; i++) {
+            if (entries[i].last_used == header->tick) {
+                entries[i].last_used = 0;
+            }
+        }
+        pthread_mutex_consistent(&header->mutex);
+    }
+}
+
+void program_cache::unlock() {
+    pthread_mutex_unlock(&header->mutex);
+}
+
+uint8_t* program_cache::slot_data(uint32_t slot) {
+    return slots + (size_t) slot * header->slot_size;
+}
+
+bool program_cache::lookup(const string& text, vector<y86_inst>& insts, vector<int32_t>& offsets) {
+    uint64_t hash = fnv1a_hash(text.data(), text.size());
+    bool found = false;
+
+    lock();
+    for (uint32_t i = 0; i < header->slot_count; i++) {
+        cache_entry& e = entries[i];
+        if (!e.last_used || e.hash != hash || e.text_len != text.size()) {
+            continue;
+        }
+        uint8_t* data = slot_data(i);
+        if (memcmp(data, text.data(), text.size()) != 0) {
+            continue;
+        }
+        const y86_inst* first = (const y86_inst*) (data + align8(e.text_len));
+        const int32_t* table = (const int32_t*) (first + e.inst_count);
+        insts.assign(first, first + e.inst_count);
+        offsets.assign(table, table + e.offset_count);
+        e.last_used = ++header->tick;
+        header->hits++;
+        found = true;
+        break;
+    }
+    if (!found) {
+        header->misses++;
+    }
+    unlock();
+    return found;
+}
+
+void program_cache::insert(const string& text, const vector<y86_inst>& insts, const vector<int32_t>& offsets) {
+    size_t need = align8(text.size()) + insts.size() * sizeof(y86_inst) + offsets.size() * sizeof(int32_t);
+    if (need > header->slot_size) {
+        return; // Too large to cache; the caller keeps its own copy
+    }
+    uint64_t hash = fnv1a_hash(text.data(), text.size());
+
+    lock();
+    // Reuse an empty slot, otherwise evict the least recently used one
+    uint32_t victim = 0;
+    for (uint32_t i = 0; i < header->slot_count; i++) {
+        if (entries[i].last_used && entries[i].hash == hash && entries[i].text_len == text.size() &&
+            memcmp(slot_data(i), text.data(), text.size()) == 0) {
+            unlock();
+            return; // Another shard inserted it first
+        }
+        if (entries[i].last_used < entries[victim].last_used) {
+            victim = i;
+        }
+    }
+    if (entries[victim].last_used) {
+        header->evictions++;
+    }
+
+    cache_entry& e = entries[victim];
+    e.hash = hash;
+    e.last_used = ++header->tick;
+    e.text_len = text.size();
+    e.inst_count = insts.size();
+    e.offset_count = offsets.size();
+    uint8_t* data = slot_data(victim);
+    memcpy(data, text.data(), text.size());
+    memcpy(data + align8(text.size()), insts.data(), insts.size() * sizeof(y86_inst));
+    memcpy(data + align8(text.size()) + insts.size() * sizeof(y86_inst), offsets.data(),
+           offsets.size() * sizeof(int32_t));
+    unlock();
+}
+
+string program_cache::stats() {
+    stringstream ss;
+    uint32_t used = 0;
+
+    lock();
+    for (uint32_t i = 0; i < header->slot_count; i++) {
+        if (entries[i].last_used) {
+            used++;
+        }
+    }
+    ss << "Program Cache: " << used << "/" << header->slot_count << " slots, "
+       << header->hits << " hits, " << header->misses << " misses, "
+       << header->evictions << " evictions";
+    unlock();
+    return ss.str();
+}
@@ -0,0 +1,42 @@
+#ifndef PROGRAM_CACHE_H // Include guard
+#define PROGRAM_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "y86_instruction_handler.h"
+
+using namespace std;
+
+struct cache_header;
+struct cache_entry;
+
+// Server-wide cache of decoded programs keyed by a hash of the program text.
+// The cache lives in one MAP_SHARED mapping, so when it is created before the
+// server forks every shard shares it. The mapping is split into fixed-size
+// slots, one program per slot, and the least recently used slot is evicted
+// when a new program needs room. A process-shared robust mutex guards it, so a
+// shard that dies holding the lock does not wedge the others.
+class program_cache {
+    private:
+        cache_header* header;
+        cache_entry* entries;
+        uint8_t* slots;
+        size_t map_size;
+
+        void lock();
+        void unlock();
+        uint8_t* slot_data(uint32_t slot);
+
+    public:
+        program_cache(size_t bytes, size_t slot_size);
+        ~program_cache();
+        bool lookup(const string& text, vector<y86_inst>& insts, vector<int32_t>& offsets);
+        void insert(const string& text, const vector<y86_inst>& insts, const vector<int32_t>& offsets);
+        string stats();
+};
+
+uint64_t fnv1a_hash(const void* data, size_t len, uint64_t hash = 0xcbf29ce484222325ULL);
+
+#endif // PROGRAM_CACHE_H
@@ -0,0 +1,90 @@
+#include "replay_log.h"
+#include <cstring>
+#include <stdexcept>
+
+// File header: magic and format version
+static const char LOG_MAGIC[8] = { 'Y', '8', '6', 'L', 'O', 'G', '\0', '1' };
+
+void pack_inst(const y86_inst& rec, string& out) {
+    char buf[LOG_INST_SIZE];
+    buf[0] = (char) rec.op;
+    buf[1] = (char) rec.rA;
+    buf[2] = (char) rec.rB;
+    memcpy(buf + 3, &rec.constval, 8);
+    out.append(buf, sizeof(buf));
+}
+
+y86_inst unpack_inst(const char* data) {
+    uint64_t constval;
+    memcpy(&constval, data + 3, 8);
+    y86_inst rec(data[1], data[2], constval, "");
+    rec.op = (inst_t) (uint8_t) data[0];
+    return rec;
+}
+
+replay_log::replay_log(const string& path, uint64_t interval)
+    : interval(interval), since_checksum(0) {
+    file = fopen(path.c_str(), "wb");
+    if (!file) {
+        throw runtime_error("Failed to open replay log " + path);
+    }
+    // A request's records are gathered into one write when it is done
+    setvbuf(file, nullptr, _IOFBF, 1 << 16);
+    fwrite(LOG_MAGIC, 1, sizeof(LOG_MAGIC), file);
+}
+
+replay_log::~replay_log() {
+    fclose(file);
+}
+
+void replay_log::record(uint8_t kind, const void* payload, uint32_t len) {
+    fwrite(&kind, 1, 1, file);
+    fwrite(&len, sizeof(len), 1, file);
+    fwrite(payload, 1, len, file);
+    if (kind != LOG_CHECKSUM) {
+        since_checksum++;
+    }
+}
+
+// Called once a request is fully recorded. A shard that crashes skips the
+// destructors, so anything still buffered would be exactly the requests
+// that led up to the crash.
+void replay_log::flush() {
+    fflush(file);
+}
+
+bool replay_log::checksum_due() {
+    return since_checksum >= interval;
+}
+
+void replay_log::checksum(uint64_t sum) {
+    record(LOG_CHECKSUM, &sum, sizeof(sum));
+    since_checksum = 0;
+}
+
+replay_reader::replay_reader(const string& path) {
+    file = fopen(path.c_str(), "rb");
+    if (!file) {
+        throw runtime_error("Failed to open replay log " + path);
+    }
+    char magic[sizeof(LOG_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0) {
+        fclose(file);
+        throw runtime_error("Not a replay log: " + path);
+    }
+}
+
+replay_reader::~replay_reader() {
+    fclose(file);
+}
+
+// Returns false at the end of the log, including a truncated last record
+bool replay_reader::next(uint8_t& kind, string& payload) {
+    uint32_t len;
+    if (fread(&kind, 1, 1, file) != 1 || fread(&len, sizeof(len), 1, file) != 1) {
+        return false;
+    }
+    payload.resize(len);
+    return len == 0 || fread(&payload[0], 1, len, file) == len;
+}
@@ -0,0 +1,56 @@
+#ifndef REPLAY_LOG_H // Include guard
+#define REPLAY_LOG_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "y86_instruction_handler.h"
+
+using namespace std;
+
+// Record kinds in a session log. Every record is a kind byte, a 32-bit
+// payload length and the payload, in host byte order.
+enum log_kind_t {
+    LOG_INST = 1,   // Single-step instruction: packed decoded record
+    LOG_LOAD,       // Loaded program: packed decoded records
+    LOG_RUN,        // One run() call: max_steps (8 bytes), resume (1 byte)
+    LOG_MEMWRITE,   // Bulk memory write: address (8 bytes), then the bytes
+    LOG_CMD,        // Breakpoint and watchpoint commands, as text
+    LOG_CHECKSUM    // State checksum (8 bytes) after the preceding records
+};
+
+// Size of a decoded instruction in the log: op, rA, rB, constval
+#define LOG_INST_SIZE 11
+
+void pack_inst(const y86_inst& rec, string& out);
+y86_inst unpack_inst(const char* data);
+
+// Append-only writer for one session's log. A checksum record is due after
+// every `interval` requests so replays can find where they diverge.
+class replay_log {
+    private:
+        FILE* file;
+        uint64_t interval;
+        uint64_t since_checksum;
+
+    public:
+        replay_log(const string& path, uint64_t interval);
+        ~replay_log();
+        void record(uint8_t kind, const void* payload, uint32_t len);
+        void flush();
+        bool checksum_due();
+        void checksum(uint64_t sum);
+};
+
+// Sequential reader used by the replay tool
+class replay_reader {
+    private:
+        FILE* file;
+
+    public:
+        replay_reader(const string& path);
+        ~replay_reader();
+        bool next(uint8_t& kind, string& payload);
+};
+
+#endif // REPLAY_LOG_H
@@ -0,0 +1,181 @@
+#include "send_queue.h"
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+// Max segments gathered into one sendmsg()
+#define SEND_IOV_MAX 64
+
+send_queue::send_queue() : queued(0), zerocopy_threshold(0), zc_next(0), zc_reaped(0) {}
+
+void send_queue::enable_zerocopy(int fd, size_t threshold) {
+    int one = 1;
+    if (threshold && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+        zerocopy_threshold = threshold;
+    }
+}
+
+void send_queue::push(string data) {
+    if (data.empty()) {
+        return;
+    }
+    segment seg;
+    seg.owned = make_unique<string>(move(data));
+    seg.data = (const uint8_t*) seg.owned->data();
+    seg.len = seg.owned->size();
+    seg.off = 0;
+    seg.zc_seq = 0;
+    seg.zc_used = false;
+    queued += seg.len;
+    segments.push_back(move(seg));
+}
+
+void send_queue::push_ref(const void* data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    segment seg;
+    seg.data = (const uint8_t*) data;
+    seg.len = len;
+    seg.off = 0;
+    seg.zc_seq = 0;
+    seg.zc_used = false;
+    queued += len;
+    segments.push_back(move(seg));
+}
+
+// Returns 1 once everything is written, 0 if the socket would block and -1
+// on error. Partial writes leave the remainder queued for the next call.
+int send_queue::flush(int fd) {
+    while (!segments.empty()) {
+        iovec iov[SEND_IOV_MAX];
+        int count = 0;
+        size_t total = 0;
+        for (auto it = segments.begin(); it != segments.end() && count < SEND_IOV_MAX; ++it) {
+            iov[count].iov_base = (void*) (it->data + it->off);
+            iov[count].iov_len = it->len - it->off;
+            total += iov[count].iov_len;
+            count++;
+        }
+
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        int flags = MSG_NOSIGNAL;
+        if (zerocopy_threshold && total >= zerocopy_threshold) {
+            flags |= MSG_ZEROCOPY;
+        }
+
+        ssize_t sent = sendmsg(fd, &msg, flags);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                // Out of optmem for pinned pages; fall back to copying
+                zerocopy_threshold = 0;
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+
+        uint32_t seq = zc_next;
+        if (flags & MSG_ZEROCOPY) {
+            zc_next++;
+        }
+
+        // Consume what was written, holding zero-copy segments until completion
+        size_t left = sent;
+        while (left > 0) {
+            segment& seg = segments.front();
+            size_t n = min(left, seg.len - seg.off);
+            seg.off += n;
+            left -= n;
+            queued -= n;
+            if (flags & MSG_ZEROCOPY) {
+                seg.zc_seq = seq;
+                seg.zc_used = true;
+            }
+            if (seg.off < seg.len) {
+                break;
+            }
+            // A segment finished by a copying send may have had its last
+            // zero-copy completion reaped already; then nothing pins it
+            if (seg.zc_used && (int32_t) (seg.zc_seq - zc_reaped) >= 0) {
+                inflight.push_back(move(seg));
+            }
+            segments.pop_front();
+        }
+    }
+    return 1;
+}
+
+// Drain MSG_ZEROCOPY completion notifications from the socket error queue
+void send_queue::reap_completions(int fd) {
+    while (true) {
+        char control[128];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            return;
+        }
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            sock_extended_err* err = (sock_extended_err*) CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // Sends [ee_info, ee_data] are done with their pages
+            uint32_t hi = err->ee_data;
+            if ((int32_t) (hi + 1 - zc_reaped) > 0) {
+                zc_reaped = hi + 1;
+            }
+            while (!inflight.empty() && (int32_t) (inflight.front().zc_seq - hi) <= 0) {
+                inflight.pop_front();
+            }
+            // The kernel had to copy anyway (e.g. loopback); stop paying for pinning
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zerocopy_threshold = 0;
+            }
+        }
+    }
+}
+
+size_t send_queue::queued_bytes() {
+    return queued;
+}
+
+bool send_queue::zerocopy_pending() {
+    return !inflight.empty();
+}
+
+bool send_queue::idle() {
+    return segments.empty() && inflight.empty();
+}
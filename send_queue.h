@@ -0,0 +1,47 @@
+#ifndef SEND_QUEUE_H // Include guard
+#define SEND_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+// Outgoing bytes for one socket, kept as a list of segments and written with
+// a single sendmsg() per flush. Segments are either owned (the queue keeps the
+// string) or referenced (sent straight from caller memory, which must stay
+// unchanged until the queue is idle). Sends at or above the zero-copy
+// threshold use MSG_ZEROCOPY, so their segments are held until the kernel
+// reports completion on the socket's error queue.
+class send_queue {
+    private:
+        struct segment {
+            unique_ptr<string> owned;   // Heap-stable so pinned pages stay valid
+            const uint8_t* data;
+            size_t len;
+            size_t off;                 // Bytes already sent
+            uint32_t zc_seq;            // Last MSG_ZEROCOPY send that covered it
+            bool zc_used;
+        };
+        deque<segment> segments;        // Not yet fully sent
+        deque<segment> inflight;        // Fully sent, waiting for zero-copy completion
+        size_t queued;                  // Unsent bytes across segments
+        size_t zerocopy_threshold;      // 0 when MSG_ZEROCOPY is off for this socket
+        uint32_t zc_next;               // Sequence number of the next MSG_ZEROCOPY send
+        uint32_t zc_reaped;             // Every MSG_ZEROCOPY send before this one has completed
+
+    public:
+        send_queue();
+        void enable_zerocopy(int fd, size_t threshold);
+        void push(string data);
+        void push_ref(const void* data, size_t len);
+        int flush(int fd);
+        void reap_completions(int fd);
+        size_t queued_bytes();
+        bool zerocopy_pending();
+        bool idle();
+};
+
+#endif // SEND_QUEUE_H
@@ -2,119 +2,1596 @@
 #include <iostream>
 #include <memory> // For smart pointers
 #include "y86_instruction_handler.h"
+#include "send_queue.h"
+#include "program_cache.h"
+#include "replay_log.h"
+#include "perf_counters.h"
+#include "shm_ring.h"
+#include "lz_codec.h"
+#include "batch_pool.h"
+#include "timer_wheel.h"
+#include "y86_batch.h"
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
 #include <csignal>
 #include <sys/wait.h>
 #include <unordered_map>
 #include <vector>
+#include <deque>
+#include <chrono>
 #include <sstream>
 #include <algorithm>
+#include <fstream>
 
 using namespace std;
 
-// Signal handler to clean up child processes
-void handle_sigchld(int sig) {
-    while (waitpid(-1, nullptr, WNOHANG) > 0); // Clean up any terminated child processes
+struct server_config {
+    int port;
+    int shards;   // Listener processes, each with its own SO_REUSEPORT socket
+    int backlog;  // listen() backlog per shard
+    uint64_t quantum;       // Instructions a running session executes before yielding
+    uint64_t inst_budget;   // Server-side instructions per session, 0 for no limit
+    uint64_t mem_budget;    // Bytes of state plus loaded program per session, 0 for no limit
+    uint64_t time_budget;   // Milliseconds of server-side execution per session, 0 for no limit
+    uint64_t zerocopy;      // Replies of at least this many bytes use MSG_ZEROCOPY, 0 to disable
+    uint64_t cache_size;    // Bytes of shared program cache, 0 to disable
+    uint64_t cache_slot;    // Largest cached program, in bytes
+    string record_dir;      // Write a replay log per session here, empty to disable
+    uint64_t checksum_interval; // Logged requests between state checksums
+    bool perf;              // Count hardware events around requests and run slices
+    string unix_path;       // Also listen on this Unix-domain socket, empty to disable
+    uint64_t hibernate_after; // Milliseconds idle before a session is compressed, 0 to disable
+    string hibernate_dir;   // Spill compressed sessions here, empty to keep them in RAM
+    uint64_t batch_workers; // Threads per shard running batch requests
+    uint64_t idle_timeout;  // Milliseconds without a request before a connection is closed, 0 to disable
+    uint64_t request_timeout; // Milliseconds a run-until or batch may take, 0 for no limit
+    uint64_t keepalive;     // Seconds idle before TCP keepalive probes, 0 to disable
+    bool shared_listener;   // All shards accept on one TCP socket instead of one each
+    string preload_path;    // Programs decoded into the program cache before forking
+    bool bulk_isa;          // New sessions start with the bulk memory instructions enabled
+};
+
+server_config config;
+
+// Decoded programs shared by every shard, mapped before they are forked
+unique_ptr<program_cache> cache;
+
+// memread replies reference session memory in segments of at most this size
+#define MEM_CHUNK 65536
+
+struct session {
+    shared_ptr<y86_instruction_handler> handler;
+    int fd;
+    bool closed;
+    bool interactive;       // Run slices are scheduled ahead of batch sessions
+    bool running;           // A run-until is queued or in progress
+    uint64_t run_limit;     // max_steps of the current run, 0 for no limit
+    uint64_t run_executed;  // Instructions executed by the current run so far
+    uint64_t insts_used;    // Instructions charged against inst_budget
+    chrono::nanoseconds time_used;
+    send_queue out;         // Replies not yet written to the socket
+    uint32_t events;        // Current epoll interest
+    uint64_t write_addr;    // Destination of the next memwrite payload byte
+    uint64_t write_left;    // memwrite payload bytes still to receive
+    uint64_t write_len;
+    bool write_ok;          // False if the payload is being discarded
+    bool local;             // Connected over the Unix-domain socket
+    unique_ptr<shm_channel> ring; // Shared memory transport, once negotiated
+    string ring_in;         // Request bytes read from the ring, not yet a whole message
+    string ring_out;        // Framed replies not yet written to the ring
+    size_t ring_out_off;
+    bool multiplex;         // Requests are framed and name one of the sessions below
+    string mux_in;          // Request bytes not yet a whole frame
+    unordered_map<uint64_t, shared_ptr<session>> channels; // Multiplexed sessions by ID
+    shared_ptr<session> conn; // For a multiplexed session, the connection it replies on
+    uint64_t channel;       // ... and its ID there
+    timer idle_timer;       // Hibernates the session after hibernate_after without requests
+    timer reap_timer;       // Closes the connection after idle_timeout without requests
+    timer deadline;         // Ends the current run or batch after request_timeout
+    bool deadline_hit;      // ... which stops the run before its next slice
+    string hibernated;      // Compressed handler state while hibernating in RAM
+    string spill_path;      // ... or the file holding it
+    uint64_t batch_left;    // batch payload bytes still to receive
+    uint64_t batch_steps;   // Per-input step limit of that batch, 0 for the default
+    string batch_buf;       // batch payload received so far
+    shared_ptr<batch_request> batch; // Batch in progress, results still to come
+
+    session(int fd)
+        : handler(make_shared<y86_instruction_handler>()), fd(fd), closed(false),
+          interactive(false), running(false), run_limit(0), run_executed(0),
+          insts_used(0), time_used(0), events(EPOLLIN), write_addr(0), write_left(0),
+          write_len(0), write_ok(false), local(false), ring_out_off(0), multiplex(false),
+          channel(0), deadline_hit(false), batch_left(0), batch_steps(0) {
+        handler->set_memory_budget(config.mem_budget);
+        if (!config.record_dir.empty()) {
+            start_recording();
+        }
+        // Through the handler's own command, so recordings replay the same
+        if (config.bulk_isa) {
+            string isa = "isa bulk";
+            handler->handle_instruction(isa);
+        }
+    }
+
+    void start_recording() {
+        static uint64_t sessions = 0;
+        string path = config.record_dir + "/session-" + to_string(getpid()) + "-" +
+                      to_string(sessions++) + ".y86log";
+        try {
+            handler->set_replay_log(make_unique<replay_log>(path, config.checksum_interval));
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+        }
+    }
+};
+
+// Map to store each client's session, indexed by the client socket.
+// Every shard process has its own copy and only ever sees its own clients.
+unordered_map<int, shared_ptr<session>> client_lists;
+
+// Sessions with a run in progress, served round robin one quantum at a time.
+// Interactive sessions always go before batch ones.
+deque<shared_ptr<session>> run_queue[2];
+
+// Sessions using the shared memory transport, indexed by their eventfd
+unordered_map<int, shared_ptr<session>> ring_sessions;
+
+// This shard's epoll instance
+int epollFd = -1;
+
+// Hibernation totals for this shard
+struct hibernate_stats {
+    uint64_t sleeping = 0;
+    uint64_t hibernations = 0;
+    uint64_t wakes = 0;
+    uint64_t raw_bytes = 0;     // Handler state held before hibernating
+    uint64_t stored_bytes = 0;  // Compressed state kept in RAM or on disk
+    chrono::nanoseconds wake_time{0};
+    chrono::nanoseconds wake_max{0};
+} hib;
+
+// Unix-domain listener, shared by every shard
+int unixSocket = -1;
+
+// With --shared-listener 1, the TCP listener shared by every shard
+int sharedSocket = -1;
+
+// With --perf, this shard's hardware counters: one group around single
+// requests to the instruction handler and one around run slices
+struct shard_perf {
+    perf_counters requests;
+    perf_counters runs;
+    uint64_t request_count = 0;
+    uint64_t run_insts = 0;
+};
+unique_ptr<shard_perf> perf;
+
+// Worker threads for batch requests, started by this shard's first batch.
+// Results are routed back to the session that submitted the request.
+unique_ptr<batch_pool> batches;
+unordered_map<batch_request*, shared_ptr<session>> batch_sessions;
+
+// Idle, hibernation and request timers of this shard's sessions, in
+// milliseconds
+unique_ptr<timer_wheel> timers;
+
+// Milliseconds on the monotonic clock, the tick of the timer wheel
+static uint64_t now_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-// Global map to store each client's instruction handler, indexed by the client socket
-unordered_map<int, shared_ptr<y86_instruction_handler>> client_lists;
+// Restart a session's idle timers after a request or the end of a run. A
+// multiplexed session's connection is active whenever the session is.
+static void touch(session& sess) {
+    if (config.hibernate_after) {
+        timers->schedule(sess.idle_timer, config.hibernate_after);
+    }
+    if (config.idle_timeout) {
+        timers->schedule(sess.conn ? sess.conn->reap_timer : sess.reap_timer, config.idle_timeout);
+    }
+}
 
 // Function to process the client's command and modify their list
-string process_command(int clientSocket, const string& command) {
-    auto handler_copy = client_lists[clientSocket];
-    return handler_copy->handle_instruction(const_cast<string&>(command)); // Avoid copying
+string process_command(shared_ptr<session>& sess, const string& command) {
+    return sess->handler->handle_instruction(const_cast<string&>(command)); // Avoid copying
+}
+
+// Compress an idle session's handler state and release it, keeping only
+// the compressed bytes in RAM or in a spill file
+static void hibernate_session(session& sess) {
+    static uint64_t spills = 0;
+    size_t resident = sess.handler->resident_bytes();
+    string raw = sess.handler->save_state();
+    string packed = lz_compress(raw.data(), raw.size());
+    size_t stored = packed.size();
+    sess.handler->release_state();
+
+    if (!config.hibernate_dir.empty()) {
+        string path = config.hibernate_dir + "/hibernate-" + to_string(getpid()) + "-" +
+                      to_string(spills++);
+        ofstream out(path, ios::binary);
+        if (out.write(packed.data(), packed.size())) {
+            sess.spill_path = path;
+            packed.clear();
+        }
+    }
+    sess.hibernated = move(packed);
+    sess.hibernated.shrink_to_fit();
+    hib.sleeping++;
+    hib.hibernations++;
+    hib.raw_bytes += resident;
+    hib.stored_bytes += stored;
+}
+
+// Bring a hibernating session back before its next request. Returns false
+// if its state cannot be restored; it then stays hibernated with nothing
+// saved, and the caller closes it.
+static bool wake_session(session& sess) {
+    if (!sess.handler->hibernated()) {
+        return true;
+    }
+    auto start = chrono::steady_clock::now();
+    string packed, raw;
+    if (!sess.spill_path.empty()) {
+        ifstream in(sess.spill_path, ios::binary);
+        packed.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        unlink(sess.spill_path.c_str());
+        sess.spill_path.clear();
+    } else {
+        packed.swap(sess.hibernated);
+    }
+    try {
+        if (!lz_decompress(packed, raw)) {
+            throw runtime_error("corrupt hibernated state");
+        }
+        sess.handler->restore_state(raw);
+    } catch (const exception& e) {
+        cerr << "Failed to wake session: " << e.what() << endl;
+        sess.handler->release_state();
+        return false;
+    }
+    chrono::nanoseconds took = chrono::steady_clock::now() - start;
+    hib.sleeping--;
+    hib.wakes++;
+    hib.wake_time += took;
+    hib.wake_max = max(hib.wake_max, took);
+    return true;
 }
 
-int main() {
-    // Register signal handler for SIGCHLD to avoid zombie processes
-    signal(SIGCHLD, handle_sigchld);
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-    // Creating socket
+// Create a listening socket bound with SO_REUSEPORT so every shard can bind
+// the same port and the kernel spreads incoming connections between them
+static int open_listener(const server_config& config) {
     int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket == -1) {
         cerr << "Failed to create socket." << endl;
-        return 1;
+        return -1;
+    }
+
+    int one = 1;
+    if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        cerr << "Failed to set socket options." << endl;
+        close(serverSocket);
+        return -1;
     }
 
     // Specifying the address
     sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
     serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(8080);
+    serverAddress.sin_port = htons(config.port);
     serverAddress.sin_addr.s_addr = INADDR_ANY;
 
     // Binding socket
     if (bind(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == -1) {
         cerr << "Failed to bind the socket." << endl;
         close(serverSocket); // Clean up
-        //comment
-        return 1;
-    } 
+        return -1;
+    }
 
     // Listening to the assigned socket
-    if (listen(serverSocket, 5) == -1) {
+    if (listen(serverSocket, config.backlog) == -1) {
         cerr << "Failed to listen on the socket." << endl;
         close(serverSocket); // Clean up
-        return 1;
+        return -1;
     }
 
-    cout << "Server is running and waiting for connections..." << endl;
+    if (set_nonblocking(serverSocket) == -1) {
+        cerr << "Failed to make the socket non-blocking." << endl;
+        close(serverSocket);
+        return -1;
+    }
+    return serverSocket;
+}
+
+// Create the Unix-domain listener before forking; every shard accepts on it
+static int open_unix_listener(const string& path, int backlog) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Unix socket path too long." << endl;
+        return -1;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock == -1) {
+        cerr << "Failed to create Unix socket." << endl;
+        return -1;
+    }
+    unlink(path.c_str()); // A stale socket file from an earlier run
+    if (bind(sock, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+        listen(sock, backlog) == -1) {
+        cerr << "Failed to listen on " << path << "." << endl;
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// A session closed while hibernating is never woken, and the rest of a
+// batch it submitted is skipped
+static void release_session(session& sess) {
+    sess.idle_timer.cancel();
+    sess.reap_timer.cancel();
+    sess.deadline.cancel();
+    if (sess.batch) {
+        sess.batch->limits.cancelled = true;
+        batch_sessions.erase(sess.batch.get());
+        sess.batch.reset();
+    }
+    if (!sess.handler->hibernated()) {
+        return;
+    }
+    if (!sess.spill_path.empty()) {
+        unlink(sess.spill_path.c_str());
+        sess.spill_path.clear();
+    }
+    hib.sleeping--;
+}
+
+static void close_client(int clientSocket) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, clientSocket, nullptr);
+    close(clientSocket);
+    // A queued run is dropped when the scheduler next reaches it
+    auto it = client_lists.find(clientSocket);
+    if (it != client_lists.end()) {
+        it->second->closed = true;
+        if (it->second->ring) {
+            int efd = it->second->ring->event_fd();
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, efd, nullptr);
+            ring_sessions.erase(efd);
+        }
+        // Multiplexed sessions go with their connection
+        release_session(*it->second);
+        for (auto& channel : it->second->channels) {
+            release_session(*channel.second);
+            channel.second->closed = true;
+            channel.second->conn.reset();
+        }
+        it->second->channels.clear();
+        client_lists.erase(it);
+    }
+}
+
+// Close one session: a multiplexed channel on its own, otherwise the
+// connection it owns
+static void close_session(shared_ptr<session>& sess) {
+    if (!sess->conn) {
+        close_client(sess->fd);
+        return;
+    }
+    sess->conn->channels.erase(sess->channel);
+    release_session(*sess);
+    sess->closed = true;
+    sess->conn.reset();
+}
+
+// Write out as much of the framed replies as the reply ring has room for.
+// If it fills up, the client wakes this shard once it has read some.
+static void flush_ring(shared_ptr<session>& sess) {
+    while (sess->ring_out_off < sess->ring_out.size()) {
+        size_t n = sess->ring->write(sess->ring_out.data() + sess->ring_out_off,
+                                     sess->ring_out.size() - sess->ring_out_off);
+        sess->ring_out_off += n;
+        if (n == 0 && sess->ring->broken()) {
+            close_client(sess->fd);
+            return;
+        }
+        if (n == 0 && sess->ring->sleep_until_writable()) {
+            return;
+        }
+    }
+    sess->ring_out.clear();
+    sess->ring_out_off = 0;
+}
+
+// Write out as much of the session's reply queue as the socket takes. Until
+// the queue is idle the session's commands are not read, which also keeps
+// any session memory referenced by queued segments unchanged.
+static void flush_session(shared_ptr<session>& sess) {
+    if (sess->closed) {
+        return;
+    }
+    if (sess->ring) {
+        flush_ring(sess);
+        return;
+    }
+    if (sess->out.flush(sess->fd) == -1) {
+        close_client(sess->fd);
+        return;
+    }
+
+    uint32_t events = EPOLLIN;
+    if (sess->out.queued_bytes()) {
+        events = EPOLLOUT;
+    } else if (sess->out.zerocopy_pending()) {
+        events = 0; // Completions arrive as EPOLLERR, which is always reported
+    }
+    if (events != sess->events) {
+        epoll_event ev;
+        ev.events = events;
+        ev.data.fd = sess->fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, sess->fd, &ev);
+        sess->events = events;
+    }
+}
 
-    // Loop to accept multiple clients
+// Multiplexed replies are framed with the session ID and may be interleaved
+// with other sessions' replies in any order
+static string frame_reply(uint64_t id, const string& response) {
+    return "@" + to_string(id) + " " + to_string(response.size()) + "\n" + response;
+}
+
+static void send_response(shared_ptr<session>& sess, string response) {
+    if (sess->conn) {
+        shared_ptr<session> conn = sess->conn;
+        send_response(conn, frame_reply(sess->channel, response));
+        return;
+    }
+    if (sess->ring) {
+        uint32_t len = response.size();
+        sess->ring_out.append((const char*) &len, sizeof(len));
+        sess->ring_out += response;
+    } else {
+        sess->out.push(move(response));
+    }
+    flush_session(sess);
+}
+
+static void start_ring(shared_ptr<session>& sess, const string& arg);
+
+// Handle commands served by the server itself. Returns false for anything
+// that should go to the instruction handler instead.
+static bool server_command(shared_ptr<session>& sess, const string& command) {
+    istringstream in(command);
+    string name, arg;
+    in >> name >> arg;
+
+    if (name == "cache-stats") {
+        send_response(sess, cache ? cache->stats() : "Program Cache: disabled");
+        return true;
+    }
+    if (name == "perf-stats") {
+        if (!perf) {
+            send_response(sess, "perf: disabled");
+        } else if (!perf->requests.available()) {
+            send_response(sess, "perf: counters unavailable (" + perf->requests.unavailable_reason() + ")");
+        } else {
+            send_response(sess, "requests (" + to_string(perf->request_count) + "): " +
+                          perf_counters::report(perf->requests.read(), perf->request_count) +
+                          "\nruns (" + to_string(perf->run_insts) + " instructions): " +
+                          perf_counters::report(perf->runs.read(), perf->run_insts));
+        }
+        return true;
+    }
+    if (name == "hibernate-stats") {
+        ostringstream ss;
+        ss << "Hibernation: " << hib.sleeping << " sleeping, " << hib.hibernations
+           << " hibernations, " << hib.wakes << " wakes";
+        if (hib.wakes) {
+            ss << ", wake avg " << chrono::duration<double, micro>(hib.wake_time).count() / hib.wakes
+               << " us, max " << chrono::duration<double, micro>(hib.wake_max).count() << " us";
+        }
+        if (hib.stored_bytes) {
+            ss << ", " << hib.raw_bytes << " resident bytes stored as " << hib.stored_bytes << " ("
+               << (double) hib.raw_bytes / hib.stored_bytes << "x)";
+        }
+        send_response(sess, ss.str());
+        return true;
+    }
+    if (name == "multiplex") {
+        if (sess->conn || sess->write_left || sess->batch_left) {
+            send_response(sess, "Error: Cannot multiplex here");
+            return true;
+        }
+        sess->multiplex = true;
+        send_response(sess, "Multiplex Enabled");
+        return true;
+    }
+    if (name == "priority") {
+        if (arg != "interactive" && arg != "batch") {
+            send_response(sess, "Error: Unknown priority");
+            return true;
+        }
+        sess->interactive = arg == "interactive";
+        send_response(sess, "Priority set to " + arg);
+        return true;
+    }
+    if (name == "transport") {
+        if (arg != "shm") {
+            send_response(sess, "Error: Unknown transport");
+        } else if (!sess->local || sess->ring || sess->conn) {
+            send_response(sess, "Error: Transport needs a Unix-domain session");
+        } else {
+            string capacity;
+            getline(in, capacity);
+            start_ring(sess, capacity);
+        }
+        return true;
+    }
+    if (name != "run-until") {
+        return false;
+    }
+    if (!sess->handler->program_loaded()) {
+        send_response(sess, "Error: No program loaded");
+        return true;
+    }
+    try {
+        sess->run_limit = arg.empty() ? 0 : stoull(arg, nullptr, 0);
+    } catch (const exception& e) {
+        send_response(sess, string("Error: ") + e.what());
+        return true;
+    }
+    sess->running = true;
+    sess->run_executed = 0;
+    sess->deadline_hit = false;
+    if (config.request_timeout) {
+        timers->schedule(sess->deadline, config.request_timeout);
+    }
+    run_queue[sess->interactive ? 0 : 1].push_back(sess);
+    return true;
+}
+
+// Give the next runnable session one quantum. The reply is only sent once
+// its run stops, so other clients are served between slices.
+static void run_slice() {
+    int level = run_queue[0].empty() ? 1 : 0;
+    shared_ptr<session> sess = run_queue[level].front();
+    run_queue[level].pop_front();
+    if (sess->closed) {
+        return;
+    }
+
+    uint64_t slice = config.quantum;
+    if (sess->run_limit) {
+        slice = min(slice, sess->run_limit - sess->run_executed);
+    }
+    stop_t reason = STOP_NONE;
+    if (config.inst_budget) {
+        if (sess->insts_used >= config.inst_budget) {
+            reason = STOP_BUDGET;
+        }
+        slice = min(slice, config.inst_budget - sess->insts_used);
+    }
+    if (config.time_budget && sess->time_used >= chrono::milliseconds(config.time_budget)) {
+        reason = STOP_BUDGET;
+    }
+    if (sess->deadline_hit) {
+        reason = STOP_DEADLINE;
+    }
+
+    if (reason == STOP_NONE) {
+        uint64_t executed = 0;
+        auto start = chrono::steady_clock::now();
+        if (perf) {
+            perf->runs.start();
+        }
+        reason = sess->handler->run(slice, &executed, sess->run_executed > 0);
+        if (perf) {
+            perf->runs.stop();
+            perf->run_insts += executed;
+        }
+        sess->time_used += chrono::steady_clock::now() - start;
+        sess->run_executed += executed;
+        sess->insts_used += executed;
+
+        // A slice running out is only a stop if the run's own limit is hit
+        if (reason == STOP_LIMIT && (!sess->run_limit || sess->run_executed < sess->run_limit)) {
+            reason = STOP_NONE;
+        }
+    }
+
+    if (reason == STOP_NONE) {
+        run_queue[level].push_back(sess);
+        return;
+    }
+    sess->running = false;
+    sess->deadline.cancel();
+    touch(*sess);
+    send_response(sess, sess->handler->stop_report(reason, sess->run_executed));
+}
+
+// Finish the session's batch, dropping any results still to come
+static void end_batch(shared_ptr<session>& sess, const string& reply) {
+    sess->batch->limits.cancelled = true;
+    batch_sessions.erase(sess->batch.get());
+    sess->batch.reset();
+    sess->running = false;
+    sess->deadline.cancel();
+    touch(*sess);
+    send_response(sess, reply);
+}
+
+// Hibernate a session whose idle timer ran out. One busy with a run or a
+// payload is touched again once that ends.
+static void idle_expired(shared_ptr<session> sess) {
+    if (sess->closed || sess->running || sess->write_left || sess->batch_left ||
+        sess->handler->hibernated()) {
+        return;
+    }
+    // Replies still queued may reference session memory
+    session& conn = sess->conn ? *sess->conn : *sess;
+    if (!conn.out.idle() || !conn.ring_out.empty()) {
+        timers->schedule(sess->idle_timer, config.hibernate_after);
+        return;
+    }
+    hibernate_session(*sess);
+}
+
+// Close a connection that sent nothing for idle_timeout, unless one of its
+// sessions is still running
+static void reap_expired(shared_ptr<session> sess) {
+    if (sess->closed) {
+        return;
+    }
+    bool busy = sess->running;
+    for (auto& channel : sess->channels) {
+        busy = busy || channel.second->running;
+    }
+    if (busy) {
+        timers->schedule(sess->reap_timer, config.idle_timeout);
+        return;
+    }
+    cout << "Client idle, closing connection." << endl;
+    close_client(sess->fd);
+}
+
+// A run past its deadline stops at its next slice; a batch stops at once
+static void deadline_expired(shared_ptr<session> sess) {
+    if (sess->closed || !sess->running) {
+        return;
+    }
+    if (!sess->batch) {
+        sess->deadline_hit = true;
+        return;
+    }
+    end_batch(sess, "Error: Deadline exceeded after " + to_string(sess->batch->completed) + " of " +
+              to_string(sess->batch->inits.size()) + " results");
+}
+
+// Point a new session's timers at it and start the idle ones. They hold it
+// weakly, so a closed session is freed as usual.
+static void arm_session(shared_ptr<session>& sess) {
+    weak_ptr<session> weak = sess;
+    sess->idle_timer.fire = [weak]() {
+        if (shared_ptr<session> s = weak.lock()) {
+            idle_expired(s);
+        }
+    };
+    sess->reap_timer.fire = [weak]() {
+        if (shared_ptr<session> s = weak.lock()) {
+            reap_expired(s);
+        }
+    };
+    sess->deadline.fire = [weak]() {
+        if (shared_ptr<session> s = weak.lock()) {
+            deadline_expired(s);
+        }
+    };
+    touch(*sess);
+}
+
+// Accept every pending connection on the listener
+static void accept_clients(int serverSocket) {
+    bool local = serverSocket == unixSocket;
     while (true) {
-        // Accepting connection request
-        int clientSocket = accept(serverSocket, nullptr, nullptr);
+        int clientSocket = accept4(serverSocket, nullptr, nullptr, SOCK_NONBLOCK);
         if (clientSocket == -1) {
-            cerr << "Failed to accept connection." << endl;
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                cerr << "Failed to accept connection." << endl;
+            }
+            return;
+        }
+
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = clientSocket;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &ev) == -1) {
+            cerr << "Failed to register client." << endl;
+            close(clientSocket);
             continue;
         }
 
-        // Create a shared_ptr for each client handler
-        client_lists[clientSocket] = make_shared<y86_instruction_handler>();
+        // Dead peers are found by the kernel's probes and reported as errors
+        if (!local && config.keepalive) {
+            int on = 1, idle = config.keepalive, count = 3;
+            setsockopt(clientSocket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+            setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+            setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+            setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+        }
 
-        // Fork a new process to handle the client
-        pid_t pid = fork();
-        if (pid == -1) {
-            cerr << "Failed to fork process." << endl;
-            close(clientSocket);
+        // Create a session for each client
+        shared_ptr<session> sess = make_shared<session>(clientSocket);
+        sess->local = local;
+        sess->out.enable_zerocopy(clientSocket, config.zerocopy);
+        arm_session(sess);
+        client_lists[clientSocket] = sess;
+    }
+}
+
+// Copy memwrite payload bytes straight into session memory
+// Returns the bytes taken; any after the payload are the next request
+static uint64_t write_payload(shared_ptr<session>& sess, const char* data, uint64_t size) {
+    uint64_t n = min(size, sess->write_left);
+    if (sess->write_ok && !sess->handler->write_memory(sess->write_addr, (const uint8_t*) data, n)) {
+        sess->write_ok = false;
+    }
+    sess->write_addr += n;
+    sess->write_left -= n;
+    if (sess->write_left) {
+        return n;
+    }
+    if (!sess->write_ok) {
+        send_response(sess, "Error Occured");
+        return n;
+    }
+    send_response(sess, "Memory Written: " + to_string(sess->write_len) + " bytes");
+    return n;
+}
+
+// memread <addr> <len> replies with a header line and the raw bytes, sent
+// straight from session memory. memwrite <addr> <len> is followed by <len>
+// raw bytes, in the same message after a newline or in later ones. Returns
+// the bytes of the message taken, or 0 if it is neither command.
+static uint64_t memory_command(shared_ptr<session>& sess, const char* data, uint64_t size) {
+    const char* eol = (const char*) memchr(data, '\n', size);
+    uint64_t header = eol ? eol - data : size;
+    istringstream in(string(data, header));
+    string name, addr_arg, len_arg;
+    uint64_t addr = 0, len = 0;
+    in >> name >> addr_arg >> len_arg;
+    if (name != "memread" && name != "memwrite") {
+        return 0;
+    }
+    try {
+        addr = stoull(addr_arg, nullptr, 0);
+        len = stoull(len_arg, nullptr, 0);
+    } catch (const exception& e) {
+        send_response(sess, "Error: Invalid memory command");
+        return size;
+    }
+    // A payload longer than any session's memory cannot be valid, so do not
+    // take its length on trust to frame the requests after it
+    if (name == "memwrite" && len > sizeof(y86_state::memory)) {
+        send_response(sess, "Error: Invalid memory command");
+        return size;
+    }
+
+    if (name == "memwrite") {
+        sess->write_addr = addr;
+        sess->write_left = len;
+        sess->write_len = len;
+        sess->write_ok = !sess->running && sess->handler->read_memory(addr, len) != nullptr;
+        if (!eol) {
+            if (len == 0) {
+                write_payload(sess, data, 0);
+            }
+            return size;
+        }
+        return header + 1 + write_payload(sess, eol + 1, size - header - 1);
+    }
+
+    const uint8_t* mem = sess->handler->read_memory(addr, len);
+    if (sess->running || !mem) {
+        send_response(sess, "Error Occured");
+        return size;
+    }
+    if (sess->ring || sess->conn) {
+        // Ring and multiplexed replies are copied anyway, so send header and
+        // bytes as one message
+        string reply = "Memory Read: " + to_string(len) + " bytes\n";
+        reply.append((const char*) mem, len);
+        send_response(sess, move(reply));
+        return size;
+    }
+    sess->out.push("Memory Read: " + to_string(len) + " bytes\n");
+    for (uint64_t off = 0; off < len; off += MEM_CHUNK) {
+        sess->out.push_ref(mem + off, min((uint64_t) MEM_CHUNK, len - off));
+    }
+    flush_session(sess);
+    return size;
+}
+
+// Hand a fully received batch to the worker pool. The program is decoded
+// once here; each worker shares it and only applies its initial state.
+static void start_batch(shared_ptr<session>& sess) {
+    string payload;
+    payload.swap(sess->batch_buf);
+    istringstream in(payload);
+    string program, line;
+    getline(in, program);
+    auto request = make_shared<batch_request>();
+    while (getline(in, line)) {
+        request->inits.push_back(line);
+    }
+    if (request->inits.empty()) {
+        send_response(sess, "Error: Batch has no initial states");
+        return;
+    }
+    if ((config.inst_budget && sess->insts_used >= config.inst_budget) ||
+        (config.time_budget && sess->time_used >= chrono::milliseconds(config.time_budget))) {
+        send_response(sess, sess->handler->stop_report(STOP_BUDGET, 0));
+        return;
+    }
+
+    request->decoded = make_shared<y86_instruction_handler>();
+    request->decoded->set_memory_budget(config.mem_budget);
+    if (sess->handler->bulk_isa_enabled()) {
+        string isa = "isa bulk";
+        request->decoded->handle_instruction(isa);
+    }
+    string load = "load " + program;
+    string reply = request->decoded->handle_instruction(load);
+    if (!request->decoded->program_loaded()) {
+        send_response(sess, reply);
+        return;
+    }
+    request->max_steps = sess->batch_steps ? sess->batch_steps : 100000000;
+    // All inputs draw on what is left of the session's budgets together
+    if (config.inst_budget) {
+        request->limits.insts_left = config.inst_budget - sess->insts_used;
+    }
+    if (config.time_budget) {
+        request->limits.nanos_left = (chrono::milliseconds(config.time_budget) - sess->time_used).count();
+    }
+
+    if (!batches) {
+        batches = make_unique<batch_pool>(config.batch_workers);
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = batches->event_fd();
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    }
+    request->start = chrono::steady_clock::now();
+    sess->running = true;
+    if (config.request_timeout) {
+        timers->schedule(sess->deadline, config.request_timeout);
+    }
+    sess->batch = request;
+    batch_sessions[request.get()] = sess;
+    batches->submit(request);
+}
+
+// Returns the bytes taken; any after the payload are the next request
+static uint64_t batch_payload(shared_ptr<session>& sess, const char* data, uint64_t size) {
+    uint64_t n = min(size, sess->batch_left);
+    sess->batch_buf.append(data, n);
+    sess->batch_left -= n;
+    if (!sess->batch_left) {
+        start_batch(sess);
+    }
+    return n;
+}
+
+// batch <len> [max_steps] is followed by <len> bytes: the program on the
+// first line, ';' separated as for load, then one initial state per line
+// in the form y86run takes. Every input runs from a fresh state, and each
+// result is sent as "Result <i> <len>" and the stop report as soon as it
+// finishes, in whatever order the workers finish them. Returns the bytes
+// of the message taken, or 0 if it is not a batch command.
+static uint64_t batch_command(shared_ptr<session>& sess, const char* data, uint64_t size) {
+    const char* eol = (const char*) memchr(data, '\n', size);
+    uint64_t header = eol ? eol - data : size;
+    istringstream in(string(data, header));
+    string name, len_arg, steps_arg;
+    uint64_t len = 0;
+    in >> name >> len_arg >> steps_arg;
+    if (name != "batch") {
+        return 0;
+    }
+    if (sess->running) {
+        send_response(sess, "Error: Session is running");
+        return size;
+    }
+    try {
+        len = stoull(len_arg, nullptr, 0);
+        sess->batch_steps = steps_arg.empty() ? 0 : stoull(steps_arg, nullptr, 0);
+    } catch (const exception& e) {
+        send_response(sess, "Error: Invalid batch command");
+        return size;
+    }
+    if (len > RING_MAX_MESSAGE) {
+        send_response(sess, "Error: Batch too large");
+        return size;
+    }
+
+    sess->batch_left = len;
+    sess->batch_buf.clear();
+    sess->batch_buf.reserve(len);
+    if (!eol) {
+        if (len == 0) {
+            start_batch(sess);
+        }
+        return size;
+    }
+    if (len == 0) {
+        start_batch(sess);
+        return header + 1;
+    }
+    return header + 1 + batch_payload(sess, eol + 1, size - header - 1);
+}
+
+// Send the results the workers have finished since the last wakeup
+static void batch_event() {
+    vector<batch_item> items;
+    batches->collect(items);
+    for (batch_item& item : items) {
+        auto it = batch_sessions.find(item.request.get());
+        if (it == batch_sessions.end()) {
+            continue; // Its session is gone
+        }
+        shared_ptr<session> sess = it->second;
+        batch_request& request = *item.request;
+        request.completed++;
+        request.instructions += item.result.executed;
+        sess->insts_used += item.result.executed;
+        sess->time_used += item.elapsed;
+        send_response(sess, "Result " + to_string(item.index) + " " +
+                      to_string(item.result.report.size()) + "\n" + item.result.report);
+        if (request.completed < request.inits.size()) {
             continue;
         }
 
-        if (pid == 0) {  // Child process
-            close(serverSocket); // Child doesn't need access to the main server socket
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - request.start;
+        ostringstream ss;
+        ss << "Batch Done: " << request.completed << " results, " << request.instructions
+           << " instructions in " << elapsed.count() << " s";
+        end_batch(sess, ss.str());
+    }
+}
 
-            char buffer[1024] = {0};
-            while (true) {
-                // Clear buffer before each receive
-                memset(buffer, 0, sizeof(buffer));
+static void handle_request(shared_ptr<session>& sess, const char* data, uint64_t size);
 
-                // Receiving data
-                int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-                if (bytesReceived <= 0) {
-                    cout << "Client disconnected." << endl;
-                    break;
-                }
+// session open|close on a multiplexed connection's channel ID
+static void channel_command(shared_ptr<session>& conn, uint64_t id, const string& command) {
+    auto it = conn->channels.find(id);
+    if (command == "session open") {
+        if (it != conn->channels.end()) {
+            send_response(conn, frame_reply(id, "Error: Session exists"));
+            return;
+        }
+        shared_ptr<session> sess = make_shared<session>(conn->fd);
+        sess->conn = conn;
+        sess->channel = id;
+        conn->channels[id] = sess;
+        arm_session(sess);
+        send_response(sess, "Session Opened");
+        return;
+    }
+    if (it == conn->channels.end()) {
+        send_response(conn, frame_reply(id, "Error: No such session"));
+        return;
+    }
+    shared_ptr<session> sess = it->second;
+    conn->channels.erase(it);
+    release_session(*sess);
+    sess->closed = true; // A queued run is dropped by the scheduler
+    send_response(sess, "Session Closed");
+    sess->conn.reset();
+}
 
-                // Process the command sent by the client
-                string command(buffer, bytesReceived);  // Create string from buffer
-                string response = process_command(clientSocket, command);
+// Requests on a multiplexed connection are framed as "@<id> <len>\n" and
+// <len> bytes, the same framing as the replies. Each frame is handled as
+// one request of that session.
+static void multiplex_input(shared_ptr<session>& conn, const char* data, uint64_t size) {
+    conn->mux_in.append(data, size);
+    size_t pos = 0;
 
-                // Send the response back to the client
-                send(clientSocket, response.c_str(), response.size(), 0);
+    while (!conn->closed) {
+        size_t eol = conn->mux_in.find('\n', pos);
+        if (eol == string::npos) {
+            if (conn->mux_in.size() - pos > 64) {
+                close_client(conn->fd); // No valid header is that long
             }
+            break;
+        }
+        uint64_t id, len;
+        char at;
+        istringstream header(conn->mux_in.substr(pos, eol - pos));
+        if (!(header >> at >> id >> len) || at != '@' || len > RING_MAX_MESSAGE) {
+            close_client(conn->fd);
+            break;
+        }
+        if (conn->mux_in.size() - eol - 1 < len) {
+            break;
+        }
+        string body = conn->mux_in.substr(eol + 1, len);
+        pos = eol + 1 + len;
 
-            // Close client socket and exit child process
-            close(clientSocket);
-            cout << "Client process closed." << endl;
-            exit(0);
-        } else {  // Parent process
-            close(clientSocket); // Parent doesn't need the client's socket, only child does
+        if (body == "session open" || body == "session close") {
+            channel_command(conn, id, body);
+            continue;
+        }
+        auto it = conn->channels.find(id);
+        if (it == conn->channels.end()) {
+            send_response(conn, frame_reply(id, "Error: No such session"));
+            continue;
+        }
+        shared_ptr<session> sess = it->second;
+        handle_request(sess, body.data(), body.size());
+    }
+    conn->mux_in.erase(0, pos);
+}
+
+// One request message, from a socket read or from the request ring
+static void handle_request(shared_ptr<session>& sess, const char* data, uint64_t size) {
+    touch(*sess);
+    if (sess->multiplex) {
+        multiplex_input(sess, data, size);
+        return;
+    }
+    if (!wake_session(*sess)) {
+        send_response(sess, "Error: Failed to restore session state");
+        close_session(sess);
+        return;
+    }
+    // Payloads of memwrite and batch, which may end partway through a
+    // message; whatever follows is handled as the next request
+    while (true) {
+        uint64_t used;
+        if (sess->write_left) {
+            used = write_payload(sess, data, size);
+        } else if (sess->batch_left) {
+            used = batch_payload(sess, data, size);
+        } else if (!(used = memory_command(sess, data, size)) &&
+                   !(used = batch_command(sess, data, size))) {
+            break;
+        }
+        data += used;
+        size -= used;
+        if (!size || sess->closed) {
+            return;
+        }
+    }
+
+    // Process the command sent by the client
+    string command(data, size);
+    if (sess->running) {
+        send_response(sess, "Error: Session is running");
+        return;
+    }
+    if (server_command(sess, command)) {
+        return;
+    }
+    if (perf) {
+        perf->requests.start();
+    }
+    string response = process_command(sess, command);
+    if (perf) {
+        perf->requests.stop();
+        perf->request_count++;
+    }
+
+    // Send the response back to the client
+    send_response(sess, response);
+}
+
+// Read requests from the ring until it is empty or replies back up. Each
+// request is handled exactly like one read from the socket.
+static void ring_event(shared_ptr<session> sess) {
+    static char buffer[65536];
+
+    sess->ring->clear_wakeup();
+    while (!sess->closed) {
+        flush_session(sess);
+        if (!sess->ring_out.empty()) {
+            return; // Woken again once the client makes room
+        }
+
+        uint32_t len = 0;
+        if (sess->ring_in.size() >= sizeof(len)) {
+            memcpy(&len, sess->ring_in.data(), sizeof(len));
+            if (len > RING_MAX_MESSAGE) {
+                close_client(sess->fd);
+                return;
+            }
+            if (sess->ring_in.size() >= sizeof(len) + len) {
+                string message = sess->ring_in.substr(sizeof(len), len);
+                sess->ring_in.erase(0, sizeof(len) + len);
+                handle_request(sess, message.data(), message.size());
+                continue;
+            }
+        }
+        size_t n = sess->ring->read(buffer, sizeof(buffer));
+        if (n) {
+            sess->ring_in.append(buffer, n);
+        } else if (sess->ring->broken()) {
+            close_client(sess->fd);
+            return;
+        } else if (sess->ring->sleep_until_readable()) {
+            return;
+        }
+    }
+}
+
+// Pass the ring's memory file and eventfds over the Unix-domain socket
+static bool send_fds(int sock, const string& reply, const int* fds, int count) {
+    iovec iov = { (void*) reply.data(), reply.size() };
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t) reply.size();
+}
+
+// transport shm [capacity]: switch a Unix-domain session to the shared
+// memory rings. The reply carries the ring's descriptors; from then on the
+// socket only signals hangup.
+static void start_ring(shared_ptr<session>& sess, const string& arg) {
+    uint64_t capacity = 65536;
+    istringstream in(arg);
+    in >> capacity;
+    if (sess->running || sess->write_left || sess->batch_left) {
+        send_response(sess, "Error: Session is busy");
+        return;
+    }
+
+    unique_ptr<shm_channel> ring;
+    try {
+        ring = make_unique<shm_channel>(capacity);
+    } catch (const exception& e) {
+        send_response(sess, string("Error: ") + e.what());
+        return;
+    }
+    int fds[3];
+    ring->fds(fds);
+    if (!send_fds(sess->fd, "Transport: shm " + to_string(ring->ring_capacity()), fds, 3)) {
+        close_client(sess->fd);
+        return;
+    }
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = ring->event_fd();
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+        close_client(sess->fd);
+        return;
+    }
+    ring_sessions[ev.data.fd] = sess;
+    sess->ring = move(ring);
+    ring_event(sess); // Requests may already be waiting
+}
+
+static void serve_client(int clientSocket) {
+    static char buffer[65536];
+    shared_ptr<session> sess = client_lists[clientSocket];
+
+    // Receiving data
+    int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
+    if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (bytesReceived <= 0) {
+        cout << "Client disconnected." << endl;
+        close_client(clientSocket);
+        return;
+    }
+    if (sess->ring) {
+        close_client(clientSocket); // Requests go through the ring now
+        return;
+    }
+    handle_request(sess, buffer, bytesReceived);
+}
+
+static void client_event(int clientSocket, uint32_t events) {
+    shared_ptr<session> sess = client_lists[clientSocket];
+
+    if (events & EPOLLERR) {
+        sess->out.reap_completions(clientSocket);
+
+        // Anything besides zero-copy completions is a real socket error
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(clientSocket, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err != 0) {
+            close_client(clientSocket);
+            return;
+        }
+    }
+    if (events & (EPOLLOUT | EPOLLERR)) {
+        flush_session(sess);
+        if (sess->closed) {
+            return;
+        }
+    }
+    if (events & EPOLLHUP) {
+        close_client(clientSocket);
+        return;
+    }
+    if ((events & EPOLLIN) && sess->out.idle()) {
+        serve_client(clientSocket);
+    }
+}
+
+// Event loop of one shard: its own listener, epoll set and session table
+static int run_shard(int shard, const server_config& config) {
+    // A shared listener keeps queued connections when a shard dies; with
+    // SO_REUSEPORT ones the kernel spreads connections more evenly
+    int serverSocket = sharedSocket != -1 ? sharedSocket : open_listener(config);
+    if (serverSocket == -1) {
+        return 1;
+    }
+
+    epollFd = epoll_create1(0);
+    if (epollFd == -1) {
+        cerr << "Failed to create epoll instance." << endl;
+        close(serverSocket);
+        return 1;
+    }
+
+    epoll_event ev;
+    ev.events = sharedSocket != -1 ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+    ev.data.fd = serverSocket;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &ev) == -1) {
+        cerr << "Failed to register listener." << endl;
+        close(epollFd);
+        close(serverSocket);
+        return 1;
+    }
+
+    // Shards share the Unix-domain listener; only one is woken per connection
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.fd = unixSocket;
+    if (unixSocket != -1 && epoll_ctl(epollFd, EPOLL_CTL_ADD, unixSocket, &ev) == -1) {
+        cerr << "Failed to register Unix listener." << endl;
+    }
+
+    if (config.perf) {
+        perf = make_unique<shard_perf>();
+        if (!perf->requests.available()) {
+            cerr << "Shard " << shard << ": hardware counters unavailable ("
+                 << perf->requests.unavailable_reason() << ")" << endl;
+        }
+    }
+
+    cout << "Shard " << shard << " is running and waiting for connections..." << endl;
+
+    timers = make_unique<timer_wheel>(now_ms());
+
+    epoll_event events[64];
+    while (true) {
+        // Only poll without blocking while there are runs to schedule, and
+        // otherwise wake up in time for the next timer
+        bool runnable = !run_queue[0].empty() || !run_queue[1].empty();
+        int timeout = runnable ? 0 : timers->next_timeout();
+        int n = epoll_wait(epollFd, events, 64, timeout);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cerr << "epoll_wait failed." << endl;
+            break;
+        }
+        // Also the base of timers scheduled while handling these events
+        timers->advance(now_ms());
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == serverSocket || fd == unixSocket) {
+                accept_clients(fd);
+            } else if (client_lists.count(fd)) {
+                client_event(fd, events[i].events);
+            } else if (ring_sessions.count(fd)) {
+                ring_event(ring_sessions[fd]);
+            } else if (batches && fd == batches->event_fd()) {
+                batch_event();
+            }
+        }
+        if (!run_queue[0].empty() || !run_queue[1].empty()) {
+            run_slice();
         }
     }
 
     // Closing the server socket (in case we ever exit the loop)
+    close(epollFd);
     close(serverSocket);
+    return 1;
+}
+
+static void usage(const char* prog) {
+    cerr << "Usage: " << prog << " [--port N] [--shards N] [--backlog N] [--quantum N]" << endl;
+    cerr << "       [--inst-budget N] [--mem-budget BYTES] [--time-budget MS]" << endl;
+    cerr << "       [--zerocopy BYTES] [--cache-size BYTES] [--cache-slot BYTES]" << endl;
+    cerr << "       [--record DIR] [--checksum-interval N] [--perf 0|1] [--unix PATH]" << endl;
+    cerr << "       [--hibernate-after MS] [--hibernate-dir DIR] [--batch-workers N]" << endl;
+    cerr << "       [--idle-timeout MS] [--request-timeout MS] [--keepalive SECONDS]" << endl;
+    cerr << "       [--shared-listener 0|1] [--preload FILE] [--bulk-isa 0|1]" << endl;
+}
+
+static int parse_args(int argc, char* argv[], server_config& config) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            return -1;
+        }
+        if (arg == "--record") {
+            config.record_dir = argv[++i];
+            continue;
+        }
+        if (arg == "--unix") {
+            config.unix_path = argv[++i];
+            continue;
+        }
+        if (arg == "--hibernate-dir") {
+            config.hibernate_dir = argv[++i];
+            continue;
+        }
+        if (arg == "--preload") {
+            config.preload_path = argv[++i];
+            continue;
+        }
+        char* end;
+        uint64_t value = strtoull(argv[++i], &end, 10);
+        if (*end != '\0') {
+            return -1;
+        }
+        if (arg == "--port") {
+            config.port = value;
+        } else if (arg == "--shards") {
+            config.shards = value;
+        } else if (arg == "--backlog") {
+            config.backlog = value;
+        } else if (arg == "--quantum") {
+            config.quantum = value;
+        } else if (arg == "--inst-budget") {
+            config.inst_budget = value;
+        } else if (arg == "--mem-budget") {
+            config.mem_budget = value;
+        } else if (arg == "--time-budget") {
+            config.time_budget = value;
+        } else if (arg == "--zerocopy") {
+            config.zerocopy = value;
+        } else if (arg == "--cache-size") {
+            config.cache_size = value;
+        } else if (arg == "--cache-slot") {
+            config.cache_slot = value;
+        } else if (arg == "--checksum-interval") {
+            config.checksum_interval = value;
+        } else if (arg == "--hibernate-after") {
+            config.hibernate_after = value;
+        } else if (arg == "--idle-timeout") {
+            config.idle_timeout = value;
+        } else if (arg == "--request-timeout") {
+            config.request_timeout = value;
+        } else if (arg == "--keepalive") {
+            config.keepalive = value;
+        } else if (arg == "--batch-workers") {
+            if (value == 0) {
+                return -1;
+            }
+            config.batch_workers = value;
+        } else if (arg == "--bulk-isa") {
+            config.bulk_isa = value != 0;
+        } else if (arg == "--shared-listener") {
+            config.shared_listener = value != 0;
+        } else if (arg == "--perf") {
+            config.perf = value != 0;
+        } else {
+            return -1;
+        }
+    }
+    if (config.port <= 0 || config.shards <= 0 || config.backlog <= 0 || config.quantum == 0 ||
+        config.checksum_interval == 0) {
+        return -1;
+    }
     return 0;
 }
+
+// Decode the programs in `path`, one per line in the form `load` takes,
+// into the program cache, so the shards forked afterwards start warm
+static int preload_programs(const string& path) {
+    ifstream in(path);
+    if (!in) {
+        cerr << "Cannot open " << path << endl;
+        return -1;
+    }
+    int loaded = 0;
+    string line;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        y86_instruction_handler handler;
+        string load = "load " + line;
+        string reply = handler.handle_instruction(load);
+        if (!handler.program_loaded()) {
+            cerr << "Failed to preload program: " << reply << endl;
+            continue;
+        }
+        loaded++;
+    }
+    return loaded;
+}
+
+static pid_t start_shard(int shard) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        cerr << "Failed to fork process." << endl;
+    } else if (pid == 0) {  // Child process
+        exit(run_shard(shard, config));
+    }
+    return pid;
+}
+
+int main(int argc, char* argv[]) {
+    config.port = 8080;
+    config.shards = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    config.backlog = SOMAXCONN;
+    config.quantum = 10000;
+    config.inst_budget = 0;
+    config.mem_budget = 0;
+    config.time_budget = 0;
+    config.zerocopy = 16384;
+    config.cache_size = 8 << 20;
+    config.cache_slot = 64 << 10;
+    config.checksum_interval = 64;
+    config.perf = false;
+    config.hibernate_after = 0;
+    config.batch_workers = 0;   // Set once the shard count is known
+    config.idle_timeout = 0;
+    config.request_timeout = 0;
+    config.keepalive = 0;
+    config.shared_listener = false;
+    config.bulk_isa = false;
+
+    if (parse_args(argc, argv, config) == -1) {
+        usage(argv[0]);
+        return 1;
+    }
+    // Every shard has its own pool, so together they use about one thread per core
+    if (!config.batch_workers) {
+        config.batch_workers = max(1L, sysconf(_SC_NPROCESSORS_ONLN) / (long) config.shards);
+    }
+
+    if (config.cache_size) {
+        try {
+            cache = make_unique<program_cache>(config.cache_size, config.cache_slot);
+            y86_instruction_handler::set_program_cache(cache.get());
+        } catch (const exception& e) {
+            cerr << e.what() << ", running without a program cache." << endl;
+        }
+    }
+
+    if (!config.preload_path.empty()) {
+        if (!cache) {
+            cerr << "--preload needs the program cache." << endl;
+            return 1;
+        }
+        int loaded = preload_programs(config.preload_path);
+        if (loaded == -1) {
+            return 1;
+        }
+        cout << "Preloaded " << loaded << " programs." << endl;
+    }
+
+    if (!config.unix_path.empty()) {
+        unixSocket = open_unix_listener(config.unix_path, config.backlog);
+        if (unixSocket == -1) {
+            return 1;
+        }
+    }
+    if (config.shared_listener) {
+        sharedSocket = open_listener(config);
+        if (sharedSocket == -1) {
+            return 1;
+        }
+    }
+
+    // Fork one long-lived shard per core up front, so no connection waits
+    // for a process to be created. A slot whose fork fails is retried from
+    // the supervision loop.
+    vector<pid_t> shards(config.shards);
+    vector<chrono::steady_clock::time_point> started(config.shards);
+    vector<chrono::steady_clock::time_point> retry_at(config.shards);
+    for (int shard = 0; shard < config.shards; shard++) {
+        shards[shard] = start_shard(shard);
+        started[shard] = chrono::steady_clock::now();
+        retry_at[shard] = started[shard] + chrono::seconds(1);
+    }
+
+    cout << "Server is running with " << config.shards << " shards on port "
+         << config.port;
+    if (unixSocket != -1) {
+        cout << " and " << config.unix_path;
+    }
+    cout << "..." << endl;
+
+    // The parent only supervises: a shard that dies is replaced, losing
+    // only its own sessions. A shard that keeps failing at startup, or that
+    // cannot be forked, is retried at most once a second; while any slot
+    // waits for its retry the others are reaped by polling, not blocking.
+    while (true) {
+        auto now = chrono::steady_clock::now();
+        bool waiting = false;
+        for (int shard = 0; shard < config.shards; shard++) {
+            if (shards[shard] != -1) {
+                continue;
+            }
+            if (now >= retry_at[shard]) {
+                shards[shard] = start_shard(shard);
+                started[shard] = now;
+                retry_at[shard] = now + chrono::seconds(1);
+            }
+            waiting |= shards[shard] == -1;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, waiting ? WNOHANG : 0);
+        if (pid == 0 || (pid == -1 && errno == ECHILD && waiting)) {
+            usleep(100000);
+            continue;
+        }
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        auto it = find(shards.begin(), shards.end(), pid);
+        if (it == shards.end()) {
+            continue;
+        }
+        int shard = it - shards.begin();
+        cerr << "Shard " << shard << " (pid " << pid << ") ";
+        if (WIFSIGNALED(status)) {
+            cerr << "killed by signal " << WTERMSIG(status);
+        } else {
+            cerr << "exited with status " << WEXITSTATUS(status);
+        }
+        cerr << ", restarting." << endl;
+
+        shards[shard] = -1;
+        retry_at[shard] = max(chrono::steady_clock::now(), started[shard] + chrono::seconds(1));
+    }
+
+    cerr << "All shards exited." << endl;
+    return 1;
+}
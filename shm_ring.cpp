@@ -0,0 +1,341 @@
+#include "shm_ring.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Positions only ever grow; the byte at position p lives at p & (capacity - 1).
+// Producer and consumer fields sit on their own cache lines.
+struct ring_header {
+    alignas(64) atomic<uint64_t> head;          // Next byte to read
+    alignas(64) atomic<uint64_t> tail;          // Next byte to write
+    alignas(64) atomic<uint32_t> reader_waiting;
+    atomic<uint32_t> writer_waiting;
+};
+
+#define RING_MAGIC 0x59383652494e4731ULL   // "Y86RING1"
+#define RING_DATA_OFFSET 4096
+
+// First page of the shared file; ring 0 carries requests, ring 1 replies
+struct channel_header {
+    uint64_t magic;
+    uint64_t capacity;
+    ring_header rings[2];
+};
+
+// Polls of the ring before a blocking side goes to sleep
+#define SPIN_LIMIT 2000
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+shm_channel::shm_channel(size_t size)
+    : map(MAP_FAILED), memfd(-1), wait_fd(-1), peer_fd(-1), hangup_fd(-1), corrupt(false) {
+    // Round up to a power of two so positions wrap with a mask
+    capacity = 4096;
+    while (capacity < size && capacity < RING_MAX_MESSAGE) {
+        capacity <<= 1;
+    }
+    map_size = RING_DATA_OFFSET + 2 * capacity;
+
+    // The file goes to the client, so seal its size: a client that could
+    // shrink it would make the server's next ring access fault
+    memfd = memfd_create("y86-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd == -1 || ftruncate(memfd, map_size) == -1 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+        int err = errno;
+        if (memfd != -1) {
+            close(memfd);
+        }
+        throw runtime_error(string("Failed to create ring: ") + strerror(err));
+    }
+    map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    wait_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    peer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (map == MAP_FAILED || wait_fd == -1 || peer_fd == -1) {
+        release();
+        throw runtime_error("Failed to map ring");
+    }
+
+    // The file starts zeroed, so both rings start empty with nobody waiting
+    channel_header* header = (channel_header*) map;
+    header->magic = RING_MAGIC;
+    header->capacity = capacity;
+    setup(true);
+}
+
+shm_channel::shm_channel(int memfd, int server_fd, int client_fd, int socket_fd)
+    : map(MAP_FAILED), memfd(memfd), wait_fd(client_fd), peer_fd(server_fd), hangup_fd(socket_fd),
+      corrupt(false) {
+    struct stat st;
+    if (fstat(memfd, &st) == -1 || st.st_size < RING_DATA_OFFSET) {
+        release();
+        throw runtime_error("Invalid ring");
+    }
+    map_size = st.st_size;
+    map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED) {
+        release();
+        throw runtime_error("Failed to map ring");
+    }
+    channel_header* header = (channel_header*) map;
+    capacity = header->capacity;
+    if (header->magic != RING_MAGIC || (capacity & (capacity - 1)) ||
+        RING_DATA_OFFSET + 2 * capacity != map_size) {
+        release();
+        throw runtime_error("Invalid ring");
+    }
+    setup(false);
+}
+
+shm_channel::~shm_channel() {
+    release();
+}
+
+void shm_channel::release() {
+    if (map != MAP_FAILED) {
+        munmap(map, map_size);
+        map = MAP_FAILED;
+    }
+    for (int* fd : { &memfd, &wait_fd, &peer_fd }) {
+        if (*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void shm_channel::setup(bool server) {
+    channel_header* header = (channel_header*) map;
+    uint8_t* data = (uint8_t*) map + RING_DATA_OFFSET;
+    in = &header->rings[server ? 0 : 1];
+    out = &header->rings[server ? 1 : 0];
+    in_data = data + (server ? 0 : capacity);
+    out_data = data + (server ? capacity : 0);
+}
+
+void shm_channel::fds(int out[3]) {
+    out[0] = memfd;
+    out[1] = wait_fd;
+    out[2] = peer_fd;
+}
+
+int shm_channel::event_fd() {
+    return wait_fd;
+}
+
+uint64_t shm_channel::ring_capacity() {
+    return capacity;
+}
+
+// The eventfd is shared with the peer, which can clear O_NONBLOCK on it, so
+// that is checked before every write: a counter the peer has filled must
+// not block this side's event loop
+void shm_channel::wake_peer() {
+    int flags = fcntl(peer_fd, F_GETFL);
+    if (flags != -1 && !(flags & O_NONBLOCK)) {
+        fcntl(peer_fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    uint64_t one = 1;
+    if (::write(peer_fd, &one, sizeof(one)) == -1) {
+        // EAGAIN: the counter is full, so the peer has a wakeup pending
+    }
+}
+
+bool shm_channel::broken() {
+    return corrupt;
+}
+
+// The peer's index is loaded once and checked before it sizes any copy. A
+// head past the tail wraps the difference, so one comparison catches both.
+size_t shm_channel::write(const char* data, size_t len) {
+    uint64_t tail = out->tail.load(memory_order_relaxed);
+    uint64_t head = out->head.load(memory_order_acquire);
+    if (corrupt || tail - head > capacity) {
+        corrupt = true;
+        return 0;
+    }
+    size_t n = min((uint64_t) len, capacity - (tail - head));
+    if (n == 0) {
+        return 0;
+    }
+    size_t off = tail & (capacity - 1);
+    size_t first = min((uint64_t) n, capacity - off);
+    memcpy(out_data + off, data, first);
+    memcpy(out_data, data + first, n - first);
+    out->tail.store(tail + n, memory_order_release);
+
+    // Pairs with the fence in sleep_until_readable: either the reader sees
+    // the new tail, or this side sees its flag and wakes it
+    atomic_thread_fence(memory_order_seq_cst);
+    if (out->reader_waiting.load(memory_order_relaxed) && out->reader_waiting.exchange(0)) {
+        wake_peer();
+    }
+    return n;
+}
+
+size_t shm_channel::read(char* data, size_t len) {
+    uint64_t head = in->head.load(memory_order_relaxed);
+    uint64_t tail = in->tail.load(memory_order_acquire);
+    if (corrupt || tail - head > capacity) {
+        corrupt = true;
+        return 0;
+    }
+    size_t n = min((uint64_t) len, tail - head);
+    if (n == 0) {
+        return 0;
+    }
+    size_t off = head & (capacity - 1);
+    size_t first = min((uint64_t) n, capacity - off);
+    memcpy(data, in_data + off, first);
+    memcpy(data + first, in_data, n - first);
+    in->head.store(head + n, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (in->writer_waiting.load(memory_order_relaxed) && in->writer_waiting.exchange(0)) {
+        wake_peer();
+    }
+    return n;
+}
+
+bool shm_channel::sleep_until_readable() {
+    in->reader_waiting.store(1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (in->tail.load() != in->head.load(memory_order_relaxed)) {
+        in->reader_waiting.store(0);
+        return false;
+    }
+    return true;
+}
+
+bool shm_channel::sleep_until_writable() {
+    out->writer_waiting.store(1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (out->tail.load(memory_order_relaxed) - out->head.load() < capacity) {
+        out->writer_waiting.store(0);
+        return false;
+    }
+    return true;
+}
+
+void shm_channel::clear_wakeup() {
+    uint64_t count;
+    if (::read(wait_fd, &count, sizeof(count)) == -1) {
+        // Nothing pending
+    }
+}
+
+bool shm_channel::ready(bool readable) {
+    if (readable) {
+        return in->tail.load(memory_order_acquire) != in->head.load(memory_order_relaxed);
+    }
+    return out->tail.load(memory_order_relaxed) - out->head.load(memory_order_acquire) < capacity;
+}
+
+// Block until the peer moves the ring, or its socket hangs up. Round trips
+// are short, so poll for a while before paying for a sleep and a wakeup.
+bool shm_channel::wait(bool readable) {
+    // With a single core the peer cannot make progress while this side spins
+    static const int spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_LIMIT : 0;
+    for (int i = 0; i < spins; i++) {
+        if (ready(readable)) {
+            return true;
+        }
+        cpu_relax();
+    }
+    if (!(readable ? sleep_until_readable() : sleep_until_writable())) {
+        return true;
+    }
+    pollfd fds[2] = { { wait_fd, POLLIN, 0 }, { hangup_fd, POLLIN, 0 } };
+    while (poll(fds, hangup_fd == -1 ? 1 : 2, -1) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+        return false;
+    }
+    clear_wakeup();
+    return true;
+}
+
+bool shm_channel::send_message(const string& message) {
+    uint32_t len = message.size();
+    string frame((const char*) &len, sizeof(len));
+    frame += message;
+    size_t off = 0;
+    while (off < frame.size()) {
+        size_t n = write(frame.data() + off, frame.size() - off);
+        off += n;
+        if (n == 0 && (corrupt || !wait(false))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool shm_channel::recv_message(string& message) {
+    uint32_t len = 0;
+    size_t got = 0;
+    while (got < sizeof(len)) {
+        size_t n = read((char*) &len + got, sizeof(len) - got);
+        got += n;
+        if (n == 0 && (corrupt || !wait(true))) {
+            return false;
+        }
+    }
+    if (len > RING_MAX_MESSAGE) {
+        return false;
+    }
+    message.resize(len);
+    got = 0;
+    while (got < len) {
+        size_t n = read(&message[got], len - got);
+        got += n;
+        if (n == 0 && (corrupt || !wait(true))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+unique_ptr<shm_channel> request_ring(int sock, size_t capacity) {
+    string request = "transport shm " + to_string(capacity);
+    if (send(sock, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t) request.size()) {
+        throw runtime_error("Failed to request ring");
+    }
+
+    char reply[256];
+    iovec iov = { reply, sizeof(reply) - 1 };
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        throw runtime_error("Server closed the connection");
+    }
+    reply[n] = '\0';
+
+    int fds[3];
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        throw runtime_error(reply); // The server's error message
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    return make_unique<shm_channel>(fds[0], fds[1], fds[2], sock);
+}
@@ -0,0 +1,79 @@
+#ifndef SHM_RING_H // Include guard
+#define SHM_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+struct ring_header;
+
+// Largest message either side accepts on a ring
+#define RING_MAX_MESSAGE (16 << 20)
+
+// A pair of single-producer single-consumer byte rings in one shared memory
+// file, for a client on the same host. The server creates it and passes the
+// memory file and two eventfds over the session's Unix-domain socket.
+//
+// Each ring carries messages framed as a 32-bit length and the bytes. A side
+// only writes to its peer's eventfd when the peer said it is about to sleep,
+// waiting for data to read or for space to write, so a busy exchange makes
+// no system calls at all.
+class shm_channel {
+    private:
+        void* map;
+        size_t map_size;
+        int memfd;
+        int wait_fd;        // Written by the peer to wake this side
+        int peer_fd;        // Written by this side to wake the peer
+        int hangup_fd;      // Socket whose hangup ends a blocking wait, or -1
+        ring_header* in;
+        ring_header* out;
+        uint8_t* in_data;
+        uint8_t* out_data;
+        uint64_t capacity;
+        bool corrupt;       // The peer left a ring index out of range
+
+        void setup(bool server);
+        void release();
+        void wake_peer();
+        bool ready(bool readable);
+        bool wait(bool readable);
+
+    public:
+        shm_channel(size_t capacity);               // Server side: create
+        shm_channel(int memfd, int server_fd, int client_fd, int socket_fd); // Client side: attach
+        ~shm_channel();
+        shm_channel(const shm_channel&) = delete;
+        shm_channel& operator=(const shm_channel&) = delete;
+
+        // Descriptors to pass to the client, in the order attach takes them
+        void fds(int out[3]);
+        int event_fd();
+        uint64_t ring_capacity();
+
+        // Non-blocking byte transfers; return the number of bytes moved.
+        // Both return 0 and mark the channel broken if the peer has put its
+        // index where no valid ring can be, and move nothing from then on.
+        size_t write(const char* data, size_t len);
+        size_t read(char* data, size_t len);
+        bool broken();
+
+        // Announce that this side will sleep. Returns false if the ring
+        // changed meanwhile and the caller should retry instead.
+        bool sleep_until_readable();
+        bool sleep_until_writable();
+        void clear_wakeup();
+
+        // Blocking framed messages, spinning briefly before sleeping
+        bool send_message(const string& message);
+        bool recv_message(string& message);
+};
+
+// Client side of "transport shm": ask the server on a connected Unix-domain
+// socket for a ring and attach to it. Throws if the server refuses.
+unique_ptr<shm_channel> request_ring(int sock, size_t capacity);
+
+#endif // SHM_RING_H
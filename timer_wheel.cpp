@@ -0,0 +1,158 @@
+#include "timer_wheel.h"
+#include <algorithm>
+
+#define SLOT_MASK ((uint64_t) WHEEL_SLOTS - 1)
+
+static void init_list(timer_link& list) {
+    list.prev = list.next = &list;
+}
+
+static void push_back(timer_link& list, timer_link& t) {
+    t.prev = list.prev;
+    t.next = &list;
+    list.prev->next = &t;
+    list.prev = &t;
+}
+
+static uint64_t rotate_right(uint64_t bits, unsigned n) {
+    return (bits >> n) | (bits << ((64 - n) & 63));
+}
+
+void timer::cancel() {
+    if (!prev) {
+        return;
+    }
+    prev->next = next;
+    next->prev = prev;
+    prev = next = nullptr;
+}
+
+timer_wheel::timer_wheel(uint64_t now) : current(now + 1) {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            init_list(slots[level][slot]);
+        }
+        occupied[level] = 0;
+    }
+    init_list(expiring);
+}
+
+// Timers still armed are detached, so they can outlive the wheel
+timer_wheel::~timer_wheel() {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            timer_link& list = slots[level][slot];
+            while (list.next != &list) {
+                static_cast<timer*>(list.next)->cancel();
+            }
+        }
+    }
+}
+
+// Tick of the last advance()
+uint64_t timer_wheel::now() {
+    return current - 1;
+}
+
+void timer_wheel::file(timer& t) {
+    uint64_t expires = max(t.expires, current);
+    uint64_t delta = expires - current;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && (delta >> (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) {
+        expires = current + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    uint64_t slot = (expires >> (WHEEL_BITS * level)) & SLOT_MASK;
+    push_back(slots[level][slot], t);
+    occupied[level] |= 1ULL << slot;
+}
+
+// Move every timer of `slot` onto the empty list `to`
+void timer_wheel::take(timer_link& slot, timer_link& to) {
+    if (slot.next == &slot) {
+        return;
+    }
+    to.next = slot.next;
+    to.prev = slot.prev;
+    to.next->prev = &to;
+    to.prev->next = &to;
+    init_list(slot);
+}
+
+// (Re)arm `t` to fire `delay` ticks from now
+void timer_wheel::schedule(timer& t, uint64_t delay) {
+    t.cancel();
+    t.expires = now() + delay;
+    file(t);
+}
+
+// Process every tick up to and including `now`, firing the timers that
+// expire. A fire function may schedule or cancel any timer, its own too.
+void timer_wheel::advance(uint64_t now) {
+    while (current <= now) {
+        uint64_t any = 0;
+        for (int level = 0; level < WHEEL_LEVELS; level++) {
+            any |= occupied[level];
+        }
+        if (!any) {
+            current = now + 1;
+            return;
+        }
+
+        // Each time a level's slot comes round, its timers move down
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if (current & ((1ULL << (WHEEL_BITS * level)) - 1)) {
+                continue;
+            }
+            uint64_t slot = (current >> (WHEEL_BITS * level)) & SLOT_MASK;
+            if (!(occupied[level] & (1ULL << slot))) {
+                continue;
+            }
+            occupied[level] &= ~(1ULL << slot);
+            timer_link moving;
+            init_list(moving);
+            take(slots[level][slot], moving);
+            while (moving.next != &moving) {
+                timer& t = *static_cast<timer*>(moving.next);
+                t.cancel();
+                file(t);
+            }
+        }
+
+        uint64_t slot = current & SLOT_MASK;
+        current++;
+        if (!(occupied[0] & (1ULL << slot))) {
+            continue;
+        }
+        occupied[0] &= ~(1ULL << slot);
+        take(slots[0][slot], expiring);
+        while (expiring.next != &expiring) {
+            timer& t = *static_cast<timer*>(expiring.next);
+            t.cancel();
+            t.fire();
+        }
+    }
+}
+
+// Ticks from now until the next tick that may fire or move a timer, or -1
+// if no timer is armed
+int64_t timer_wheel::next_timeout() {
+    int64_t best = -1;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (!occupied[level]) {
+            continue;
+        }
+        // The level's slots come round every `span` ticks, starting at `first`
+        uint64_t span = 1ULL << (WHEEL_BITS * level);
+        uint64_t first = (current + span - 1) & ~(span - 1);
+        uint64_t index = (first >> (WHEEL_BITS * level)) & SLOT_MASK;
+        uint64_t ahead = __builtin_ctzll(rotate_right(occupied[level], index));
+        int64_t wait = first + ahead * span - now();
+        if (best == -1 || wait < best) {
+            best = wait;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,64 @@
+#ifndef TIMER_WHEEL_H // Include guard
+#define TIMER_WHEEL_H
+
+#include <cstdint>
+#include <functional>
+
+using namespace std;
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct timer_link {
+    timer_link* prev;
+    timer_link* next;
+};
+
+// A timer embedded in the object it times. It sits on at most one slot list
+// and unlinks itself when cancelled or destroyed, so neither needs the wheel.
+struct timer : timer_link {
+    uint64_t expires;       // Tick it fires at
+    function<void()> fire;
+
+    timer() : timer_link{nullptr, nullptr}, expires(0) {}
+    ~timer() { cancel(); }
+    timer(const timer&) = delete;
+    timer& operator=(const timer&) = delete;
+
+    bool armed() const { return prev != nullptr; }
+    void cancel();
+};
+
+// Hierarchical timer wheel with WHEEL_LEVELS levels of WHEEL_SLOTS slots.
+// Level 0 has one slot per tick, and each level above covers WHEEL_SLOTS
+// slots of the one below. A timer is filed in the lowest level whose span
+// reaches its expiry and moves down a level each time the wheel reaches its
+// slot. Scheduling and cancelling are a list link/unlink; a tick costs one
+// level 0 slot plus, every WHEEL_SLOTS ticks, one slot per level above.
+// Timers beyond the top level's span are refiled until they come into range.
+class timer_wheel {
+    private:
+        timer_link slots[WHEEL_LEVELS][WHEEL_SLOTS];
+        // Slots that may hold timers. Cancelling leaves the bit set until
+        // the slot is next processed, which at worst wakes the loop early.
+        uint64_t occupied[WHEEL_LEVELS];
+        timer_link expiring;    // Timers of the tick being fired
+        uint64_t current;       // Next tick to process
+
+        void file(timer& t);
+        void take(timer_link& slot, timer_link& to);
+
+    public:
+        timer_wheel(uint64_t now);
+        ~timer_wheel();
+        timer_wheel(const timer_wheel&) = delete;
+        timer_wheel& operator=(const timer_wheel&) = delete;
+
+        uint64_t now();
+        void schedule(timer& t, uint64_t delay);
+        void advance(uint64_t now);
+        int64_t next_timeout();
+};
+
+#endif // TIMER_WHEEL_H
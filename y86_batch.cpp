@@ -0,0 +1,150 @@
+#include "y86_batch.h"
+#include <sstream>
+#include <stdexcept>
+
+// Instructions run between checks of a batch item's limits
+#define CANCEL_SLICE (1 << 20)
+
+// Join a program file into the ';' separated form the load command takes
+string program_to_load(const string& program) {
+    string text;
+    stringstream in(program);
+    string line;
+
+    while (getline(in, line)) {
+        size_t comment = line.find('#');
+        if (comment != string::npos) {
+            line.erase(comment);
+        }
+        if (line.find_first_not_of(" \t\r") == string::npos) {
+            continue;
+        }
+        if (!text.empty()) {
+            text += ';';
+        }
+        text += line;
+    }
+    return text;
+}
+
+static uint64_t parse_value(const string& value) {
+    size_t used = 0;
+    uint64_t v = stoull(value, &used, 0);
+    if (used != value.size()) {
+        throw invalid_argument("Bad value " + value);
+    }
+    return v;
+}
+
+// Registers are given by number (r0..r14), memory as 8-byte little-endian quads
+void apply_init(y86_instruction_handler& handler, const string& init) {
+    stringstream in(init);
+    string item;
+
+    while (in >> item) {
+        if (item[0] == '#') {
+            string rest;
+            getline(in, rest);
+            continue;
+        }
+        size_t eq = item.find('=');
+        if (eq == string::npos) {
+            throw invalid_argument("Bad initial state " + item);
+        }
+        string key = item.substr(0, eq);
+        uint64_t value = parse_value(item.substr(eq + 1));
+
+        if (key == "pc") {
+            handler.set_pc(value);
+        } else if (key.size() > 1 && key[0] == 'r') {
+            uint64_t reg = parse_value(key.substr(1));
+            if (reg > 0xff || !handler.set_register(reg, value)) {
+                throw invalid_argument("Bad register " + key);
+            }
+        } else if (key.size() > 3 && key.compare(0, 2, "m[") == 0 && key.back() == ']') {
+            uint64_t addr = parse_value(key.substr(2, key.size() - 3));
+            uint8_t bytes[8];
+            for (int i = 0; i < 8; i++) {
+                bytes[i] = (uint8_t) (value >> (8 * i));
+            }
+            if (!handler.write_memory(addr, bytes, 8)) {
+                throw invalid_argument("Address out of range " + key);
+            }
+        } else {
+            throw invalid_argument("Bad initial state " + item);
+        }
+    }
+}
+
+// Run one job on a reused handler. The initial PC is applied before the
+// load, so the program is laid out from it.
+batch_result run_job(y86_instruction_handler& handler, const batch_job& job, uint64_t max_steps) {
+    batch_result result{job.name, STOP_ERROR, 0, ""};
+
+    handler.reset();
+    try {
+        apply_init(handler, job.init);
+        string load = "load " + program_to_load(job.program);
+        string reply = handler.handle_instruction(load);
+        if (!handler.program_loaded()) {
+            result.report = reply + "\n";
+            return result;
+        }
+        result.reason = handler.run(max_steps, &result.executed);
+        result.report = handler.stop_report(result.reason, result.executed);
+    } catch (const exception& e) {
+        result.report = string("Error: ") + e.what() + "\n";
+    }
+    return result;
+}
+
+// Take up to `want` instructions from a shared budget
+static uint64_t claim(atomic<uint64_t>& left, uint64_t want) {
+    uint64_t have = left.load(memory_order_relaxed);
+    uint64_t take;
+    do {
+        take = min(want, have);
+    } while (take && !left.compare_exchange_weak(have, have - take, memory_order_relaxed));
+    return take;
+}
+
+// Run one initial state of a program already decoded into `decoded`. With
+// `limits`, the run goes in slices, stops with STOP_BUDGET once the shared
+// budgets run out and gives up once the batch is cancelled.
+batch_result run_decoded(y86_instruction_handler& handler, const y86_instruction_handler& decoded,
+                         const string& init, uint64_t max_steps, run_limits* limits) {
+    batch_result result{"", STOP_ERROR, 0, ""};
+
+    handler.reset();
+    try {
+        apply_init(handler, init);
+        handler.share_program(decoded);
+        uint64_t slice = limits ? CANCEL_SLICE : max_steps;
+        do {
+            uint64_t executed = 0;
+            uint64_t steps = max_steps ? min(slice, max_steps - result.executed) : slice;
+            if (!limits) {
+                result.reason = handler.run(steps, &executed);
+                result.executed += executed;
+                continue;
+            }
+            steps = claim(limits->insts_left, steps);
+            if (steps == 0 || limits->nanos_left.load(memory_order_relaxed) <= 0) {
+                limits->insts_left += steps;
+                result.reason = STOP_BUDGET;
+                break;
+            }
+            auto start = chrono::steady_clock::now();
+            result.reason = handler.run(steps, &executed);
+            result.executed += executed;
+            limits->insts_left += steps - executed;
+            limits->nanos_left -= chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - start).count();
+        } while (result.reason == STOP_LIMIT && (!max_steps || result.executed < max_steps) &&
+                 limits && !limits->cancelled);
+        result.report = handler.stop_report(result.reason, result.executed);
+    } catch (const exception& e) {
+        result.report = string("Error: ") + e.what() + "\n";
+    }
+    return result;
+}
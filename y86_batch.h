@@ -0,0 +1,43 @@
+#ifndef Y86_BATCH_H // Include guard
+#define Y86_BATCH_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include "y86_instruction_handler.h"
+
+using namespace std;
+
+// One program run from an initial state, without going through the server
+struct batch_job {
+    string name;
+    string program;     // Instructions separated by ';' or newlines; '#' starts a comment
+    string init;        // Initial state: whitespace separated rN=V, pc=V and m[ADDR]=V
+};
+
+struct batch_result {
+    string name;
+    stop_t reason;
+    uint64_t executed;
+    string report;      // Stop reason and final state dump, or the error
+};
+
+// Limits shared by every run of one batch, checked between slices. Runs
+// claim instructions a slice at a time and hand back what they did not
+// use, so together they never overdraw the budget; time is charged after
+// each slice. The initial maximums mean no limit.
+struct run_limits {
+    atomic<bool> cancelled{false};
+    atomic<uint64_t> insts_left{UINT64_MAX};
+    atomic<int64_t> nanos_left{INT64_MAX};
+};
+
+string program_to_load(const string& program);
+void apply_init(y86_instruction_handler& handler, const string& init);
+batch_result run_job(y86_instruction_handler& handler, const batch_job& job, uint64_t max_steps);
+batch_result run_decoded(y86_instruction_handler& handler, const y86_instruction_handler& decoded,
+                         const string& init, uint64_t max_steps,
+                         run_limits* limits = nullptr);
+
+#endif // Y86_BATCH_H
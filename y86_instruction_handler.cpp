@@ -1,4 +1,6 @@
 #include "y86_instruction_handler.h"
+#include "program_cache.h"
+#include "replay_log.h"
 #include <iostream>
 #include <cstring>
 #include <sstream>
@@ -6,13 +8,14 @@
 #include <vector>
 #include <cstdint>
 #include <iomanip>
+#include <array>
 
 struct cmd_map_t {
     char* cmd_str;
     inst_t cmd;
 };
 
-struct cmd_map_t cmd_map [30] = {
+struct cmd_map_t cmd_map [33] = {
         { "nop", I_NOP},
         { "halt", I_HALT},
         { "rrmovq", I_RRMOVQ},
@@ -42,7 +45,10 @@ struct cmd_map_t cmd_map [30] = {
         { "cmovl", I_CMOVL},
         { "cmovle", I_CMOVLE},
         { "cmovg", I_CMOVG},
-        { "cmovge", I_CMOVGE }
+        { "cmovge", I_CMOVGE },
+        { "bcopy", I_BCOPY },
+        { "bfill", I_BFILL },
+        { "bcmp", I_BCMP }
 };
 
 vector<string> split(const string& str) {
@@ -63,7 +69,53 @@ vector<string> split(const string& str) {
     return tokens;
 }
 
-y86_instruction_handler::y86_instruction_handler() {
+// Encoded length in bytes of each instruction, matching update_PC()
+static uint64_t inst_length(inst_t enum_inst) {
+    switch (enum_inst) {
+        case I_NOP:
+        case I_HALT:
+        case I_RET:
+            return 1;
+        case I_IRMOVQ:
+        case I_RMMOVQ:
+        case I_MRMOVQ:
+            return 10;
+        case I_CALL:
+        case I_J:
+        case I_JEQ:
+        case I_JNE:
+        case I_JL:
+        case I_JLE:
+        case I_JG:
+        case I_JGE:
+            return 9;
+        default:
+            return 2;
+    }
+}
+
+// Offset table for a program laid out contiguously: byte offset -> index
+static void layout_program(const vector<y86_inst>& loaded, vector<int32_t>& offsets) {
+    uint64_t offset = 0;
+    offsets.clear();
+    for (size_t i = 0; i < loaded.size(); i++) {
+        uint64_t len = inst_length(loaded[i].op);
+        offsets.resize(offset + len, -1);
+        offsets[offset] = i;
+        offset += len;
+    }
+}
+
+// Parse an address argument, accepting decimal or 0x-prefixed hex
+static uint64_t parse_addr(const string& str) {
+    return stoull(str, nullptr, 0);
+}
+
+program_cache* y86_instruction_handler::cache = nullptr;
+
+y86_instruction_handler::y86_instruction_handler()
+    : inst(nullptr), prog_base(0), watch_pages(0), watch_hit(false), watch_addr(0), bulk_isa(false),
+      memory_budget(0) {
     // Initialize the memory and registers
     array<uint8_t, 1024> memory = { 0 };
     array<uint64_t, 16> registers = { 0 };
@@ -79,6 +131,131 @@ y86_instruction_handler::y86_instruction_handler() {
     );
 }
 
+// Return to the freshly constructed state so pooled handlers can be reused
+void y86_instruction_handler::reset() {
+    memset(state->memory, 0, sizeof(state->memory));
+    memset(state->registers, 0, sizeof(state->registers));
+    state->start_addr = 0;
+    state->valid_mem = 1024;
+    state->pc = 0;
+    state->flags = 0;
+    state->cc_pending = 0;
+    state->cc_result = 0;
+    program.clear();
+    prog_offsets.clear();
+    prog_base = 0;
+    breakpoints.clear();
+    watchpoints.clear();
+    watch_pages = 0;
+    watch_hit = false;
+}
+
+template <typename T>
+static void put_items(string& out, const T* items, uint32_t count) {
+    out.append((const char*) &count, sizeof(count));
+    out.append((const char*) items, count * sizeof(T));
+}
+
+template <typename T>
+static void get_items(const string& in, size_t& off, vector<T>& items, const T& blank) {
+    uint32_t count;
+    if (in.size() - off < sizeof(count)) {
+        throw invalid_argument("Truncated saved state");
+    }
+    memcpy(&count, in.data() + off, sizeof(count));
+    off += sizeof(count);
+    if ((in.size() - off) / sizeof(T) < count) {
+        throw invalid_argument("Truncated saved state");
+    }
+    items.assign(count, blank);
+    memcpy((void*) items.data(), in.data() + off, count * sizeof(T));
+    off += count * sizeof(T);
+}
+
+// Everything a session needs to continue: the machine state, the loaded
+// program, breakpoints and watchpoints. The program is packed as in replay
+// logs and its offset table is rebuilt on restore.
+string y86_instruction_handler::save_state() {
+    string out((const char*) state.get(), sizeof(y86_state));
+    out.append((const char*) &prog_base, sizeof(prog_base));
+    string packed;
+    for (const y86_inst& rec : program) {
+        pack_inst(rec, packed);
+    }
+    put_items(out, packed.data(), packed.size());
+    vector<uint64_t> breaks(breakpoints.begin(), breakpoints.end());
+    put_items(out, breaks.data(), breaks.size());
+    put_items(out, watchpoints.data(), watchpoints.size());
+    return out;
+}
+
+void y86_instruction_handler::restore_state(const string& saved) {
+    if (saved.size() < sizeof(y86_state) + sizeof(prog_base)) {
+        throw invalid_argument("Truncated saved state");
+    }
+    size_t off = sizeof(y86_state) + sizeof(prog_base);
+    vector<char> packed;
+    vector<uint64_t> breaks;
+    vector<y86_watch> watches;
+    get_items(saved, off, packed, '\0');
+    get_items(saved, off, breaks, (uint64_t) 0);
+    get_items(saved, off, watches, y86_watch{0, 0});
+    if (packed.size() % LOG_INST_SIZE != 0) {
+        throw invalid_argument("Malformed saved program");
+    }
+    vector<y86_inst> loaded;
+    vector<int32_t> offsets;
+    for (size_t i = 0; i < packed.size(); i += LOG_INST_SIZE) {
+        loaded.push_back(unpack_inst(packed.data() + i));
+        validate(loaded.back());
+    }
+    layout_program(loaded, offsets);
+
+    if (!state) {
+        array<uint8_t, 1024> memory = { 0 };
+        array<uint64_t, 16> registers = { 0 };
+        state = make_unique<y86_state>(memory.data(), 0, 1024, registers.data(), 0, 0);
+    }
+    memcpy((void*) state.get(), saved.data(), sizeof(y86_state));
+    memcpy(&prog_base, saved.data() + sizeof(y86_state), sizeof(prog_base));
+    program.swap(loaded);
+    prog_offsets.swap(offsets);
+    breakpoints = unordered_set<uint64_t>(breaks.begin(), breaks.end());
+    watchpoints.swap(watches);
+    rearm_watch_pages();
+}
+
+// Drop the state of a hibernating session; restore_state() brings it back
+void y86_instruction_handler::release_state() {
+    state.reset();
+    parsed.reset();
+    inst = nullptr;
+    vector<y86_inst>().swap(program);
+    vector<int32_t>().swap(prog_offsets);
+    unordered_set<uint64_t>().swap(breakpoints);
+    vector<y86_watch>().swap(watchpoints);
+    watch_pages = 0;
+}
+
+bool y86_instruction_handler::hibernated() {
+    return !state;
+}
+
+// Heap bytes held for the session's state, program and debugging aids
+size_t y86_instruction_handler::resident_bytes() {
+    return (state ? sizeof(y86_state) : 0) + program.capacity() * sizeof(y86_inst) +
+           prog_offsets.capacity() * sizeof(int32_t) + breakpoints.size() * 32 +
+           watchpoints.capacity() * sizeof(y86_watch);
+}
+
+y86_instruction_handler::~y86_instruction_handler() {
+    // Close the log with the final state so a replay verifies to the end.
+    // A session that ends hibernated has had no requests since its last one.
+    if (log && state) {
+        log->checksum(state_checksum());
+    }
+}
+
 void y86_instruction_handler::convert_to_inst(string& instruction) {
     // Split the instruction into tokens
     vector<string> tokens = split(instruction);
@@ -99,10 +276,10 @@ void y86_instruction_handler::convert_to_inst(string& instruction) {
 
     if (token == "halt" || token == "nop") {
         // For instructions with no operands
-        inst = make_unique<y86_inst>(0, 0, 0, inst_name);
+        parsed = make_unique<y86_inst>(0, 0, 0, inst_name);
     } else if (token == "ret") {
         // Similar to halt and nop
-        inst = make_unique<y86_inst>(0, 0, 0, inst_name);
+        parsed = make_unique<y86_inst>(0, 0, 0, inst_name);
     } else if (token == "pushq" || token == "popq") {
         // Push/Pop uses only one register
         if (tokens.size() < 2 || tokens[1].size() < 2 || tokens[1][0] != 'r') {
@@ -113,11 +290,16 @@ void y86_instruction_handler::convert_to_inst(string& instruction) {
         } else {
             rA = stoi(tokens[1].substr(1, 2));
         }
-        inst = make_unique<y86_inst>(rA, 0, 0, inst_name);
-    } else if (token.substr(0) == "j") {
+        parsed = make_unique<y86_inst>(rA, 0, 0, inst_name);
+    } else if (token[0] == 'j' || token == "call") {
+        // Jumps and call take a single destination address
+        if (tokens.size() < 2) {
+            throw invalid_argument("Invalid instruction format");
+        }
         constval = stoull(tokens[1]);
-        inst = make_unique<y86_inst>(0, 0, constval, inst_name);
-    } else if (token == "rrmovq" || token.substr(0, 4) == "cmov" || token.size() == 4) {
+        parsed = make_unique<y86_inst>(0, 0, constval, inst_name);
+    } else if (token == "rrmovq" || token.substr(0, 4) == "cmov" || token.size() == 4 ||
+               token == "bcopy" || token == "bfill") {
         // Conditional move or register move
         if (tokens.size() < 3 || tokens[1].size() < 2 || tokens[1][0] != 'r') {
             throw invalid_argument("Invalid register in instruction");
@@ -137,7 +319,7 @@ void y86_instruction_handler::convert_to_inst(string& instruction) {
             rB = stoi(tokens[2].substr(1, 2));
         }
         
-        inst = make_unique<y86_inst>(rA, rB, 0, inst_name); // Use inst_name here
+        parsed = make_unique<y86_inst>(rA, rB, 0, inst_name); // Use inst_name here
     } else if (token == "irmovq") {
         // Immediate value followed by register
         if (tokens.size() < 3 || tokens[1].empty() || tokens[2].size() < 2 || tokens[2][0] != 'r') {
@@ -149,7 +331,7 @@ void y86_instruction_handler::convert_to_inst(string& instruction) {
         } else {
             rB = stoi(tokens[2].substr(1, 2));
         }
-        inst = make_unique<y86_inst>(0, rB, constval, inst_name); // Use inst_name here
+        parsed = make_unique<y86_inst>(0, rB, constval, inst_name); // Use inst_name here
     } else if (token == "rmmovq") {
         // Register move with displacement
         if (tokens.size() < 2 || tokens[1].size() < 2 || tokens[1][0] != 'r') {
@@ -172,7 +354,7 @@ void y86_instruction_handler::convert_to_inst(string& instruction) {
         constval = stoull(tokens[2].substr(0, tokens[2].size() - 4));
         rB = stoi(tokens[2].substr(tokens[2].size() - 2, 1));
 
-        inst = make_unique<y86_inst>(rA, rB, constval, inst_name); // Use inst_name here
+        parsed = make_unique<y86_inst>(rA, rB, constval, inst_name); // Use inst_name here
     } else if (token == "mrmovq") {
         // Similar to rmmovq
         if (tokens.size() < 3 || tokens[1].size() < 4 || 
@@ -197,12 +379,58 @@ void y86_instruction_handler::convert_to_inst(string& instruction) {
             rA = stoi(tokens[2].substr(1, 2));
         }
 
-        inst = make_unique<y86_inst>(rA, rB, constval, inst_name); // Use inst_name here
+        parsed = make_unique<y86_inst>(rA, rB, constval, inst_name); // Use inst_name here
     } else {
         throw invalid_argument("Unknown instruction");
     }
 }
 
+void y86_instruction_handler::decode(y86_inst& rec) {
+    rec.op = inst_to_enum(rec.instruction);
+    validate(rec);
+}
+
+void y86_instruction_handler::validate(y86_inst& rec) {
+    // Register operands are validated once here so the execution
+    // handlers can index state->registers without checking
+    switch (rec.op) {
+        case I_INVALID:
+            rec.valid = 0;
+            break;
+        case I_IRMOVQ:
+            rec.valid = rec.rB < 0xf;
+            break;
+        case I_PUSHQ:
+        case I_POPQ:
+            rec.valid = rec.rA < 0xf;
+            break;
+        case I_RRMOVQ:
+        case I_RMMOVQ:
+        case I_MRMOVQ:
+        case I_ADDQ:
+        case I_SUBQ:
+        case I_MULQ:
+        case I_MODQ:
+        case I_DIVQ:
+        case I_ANDQ:
+        case I_XORQ:
+        case I_CMOVEQ:
+        case I_CMOVNE:
+        case I_CMOVL:
+        case I_CMOVLE:
+        case I_CMOVG:
+        case I_CMOVGE:
+        case I_BCOPY:
+        case I_BFILL:
+        case I_BCMP:
+            rec.valid = rec.rA < 0xf && rec.rB < 0xf;
+            break;
+        default:
+            rec.valid = 1;
+            break;
+    }
+}
+
 string y86_instruction_handler::dump_state() {
     stringstream ss;
 
@@ -215,7 +443,7 @@ string y86_instruction_handler::dump_state() {
     ss << "\n";
     ss << "FLAGS: ";
 
-    switch ((state->flags & 0x64)) {
+    switch ((get_flags() & 0x64)) {
         case 0:
             ss << "---";
             break;
@@ -252,10 +480,11 @@ string y86_instruction_handler::dump_state() {
 }
 
 int y86_instruction_handler::read_quad(uint64_t address, uint64_t *value) {
-	if (address < state->start_addr || address + 8 > state->start_addr + state->valid_mem) {
+    // One unsigned compare: addresses below start_addr wrap to a huge index
+    uint64_t index = address - state->start_addr;
+    if (index > state->valid_mem - 8) {
         return 0;
     }
-    uint64_t index = address - state->start_addr;
 
     memcpy(value, &state->memory[index], 8);
 
@@ -263,20 +492,98 @@ int y86_instruction_handler::read_quad(uint64_t address, uint64_t *value) {
 }
 
 int y86_instruction_handler::write_quad(uint64_t address, uint64_t value) {
-    if (address < state->start_addr || address + 8 > state->start_addr + state->valid_mem) {
+    uint64_t index = address - state->start_addr;
+    if (index > state->valid_mem - 8) {
         return 0;
     }
-    uint64_t index = address - state->start_addr;
 	uint64_t * temp;
 	temp = &value;
 
     memcpy(&state->memory[index],temp, 8);
 
+    // Only pages with an armed watchpoint pay for the range scan
+    if (watch_pages & (1ULL << (index >> WATCH_PAGE_SHIFT))) {
+        check_watch(address);
+    }
     return 1;
 }
 
+// Bulk access for the memread/memwrite commands and the bulk instructions:
+// one range check per call. Returns a pointer into state->memory, or
+// nullptr if the range is invalid.
+uint8_t* y86_instruction_handler::memory_range(uint64_t address, uint64_t len) {
+    uint64_t index = address - state->start_addr;
+    if (index > state->valid_mem || len > state->valid_mem - index) {
+        return nullptr;
+    }
+    return &state->memory[index];
+}
+
+const uint8_t* y86_instruction_handler::read_memory(uint64_t address, uint64_t len) {
+    return memory_range(address, len);
+}
+
+int y86_instruction_handler::write_memory(uint64_t address, const uint8_t* data, uint64_t len) {
+    uint64_t index = address - state->start_addr;
+    if (index > state->valid_mem || len > state->valid_mem - index) {
+        return 0;
+    }
+    memcpy(&state->memory[index], data, len);
+    if (watch_pages && len) {
+        check_watch(address, len);
+    }
+
+    if (log) {
+        string payload((const char*) &address, 8);
+        payload.append((const char*) data, len);
+        log_record(LOG_MEMWRITE, payload);
+        log_done();
+    }
+    return 1;
+}
+
+void y86_instruction_handler::check_watch(uint64_t address, uint64_t len) {
+    for (const y86_watch& w : watchpoints) {
+        if (address < w.addr + w.len && w.addr < address + len) {
+            watch_hit = true;
+            watch_addr = address;
+            return;
+        }
+    }
+}
+
+void y86_instruction_handler::rearm_watch_pages() {
+    watch_pages = 0;
+    for (const y86_watch& w : watchpoints) {
+        uint64_t first = (w.addr - state->start_addr) >> WATCH_PAGE_SHIFT;
+        uint64_t last = (w.addr + w.len - 1 - state->start_addr) >> WATCH_PAGE_SHIFT;
+        for (uint64_t page = first; page <= last; page++) {
+            watch_pages |= 1ULL << page;
+        }
+    }
+}
+
+void y86_instruction_handler::set_cc(int64_t valE) {
+	state->cc_result = valE;
+	state->cc_pending = 1;
+}
+
+uint8_t y86_instruction_handler::get_flags() {
+	if (state->cc_pending) {
+		state->flags = 0;
+		if (state->cc_result == 0) {
+			state->flags |= FLAG_Z;
+		}
+		if (state->cc_result < 0) {
+			state->flags |= FLAG_S;
+		}
+		state->cc_pending = 0;
+	}
+	return state->flags;
+}
+
 void y86_instruction_handler::update_PC() {
-    inst_t enum_inst = inst_to_enum(inst->instruction);
+    inst_t enum_inst = inst->op;
     if (enum_inst == I_NOP) {
 		state->pc += 1;
 	} else if (enum_inst == I_RRMOVQ || enum_inst == I_CMOVEQ || 
@@ -286,7 +593,9 @@ void y86_instruction_handler::update_PC() {
 				enum_inst == I_SUBQ || enum_inst == I_MULQ ||
 				enum_inst == I_MODQ || enum_inst == I_DIVQ ||
 				enum_inst == I_ANDQ || enum_inst == I_XORQ ||
-				enum_inst == I_PUSHQ || enum_inst == I_POPQ) {
+				enum_inst == I_PUSHQ || enum_inst == I_POPQ ||
+				enum_inst == I_BCOPY || enum_inst == I_BFILL ||
+				enum_inst == I_BCMP) {
 		state->pc += 2;
 	} else if (enum_inst == I_IRMOVQ || enum_inst == I_RMMOVQ ||
 				enum_inst == I_MRMOVQ) {
@@ -299,126 +608,71 @@ void y86_instruction_handler::update_PC() {
 }
 
 int y86_instruction_handler::irmovq() {
-    if(inst->rB < 0x0 || inst->rB >= 0xF) {
-		return 0;
-	}
 	state->registers[(int) inst->rB] = inst->constval;
 	return 1;
 }
 
 int y86_instruction_handler::rrmovq() {
-	// Validate Registers
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
 	state->registers[(int) inst->rB] = state->registers[(int) inst->rA];
 	return 1;
 }
 
 int y86_instruction_handler::addq() {
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
 	int64_t valA = (int64_t) state->registers[inst->rA];
 	int64_t valB = (int64_t) state->registers[inst->rB];
 	
 	int64_t valE = valA + valB;
 	state->registers[inst->rB] = valE;
 
-	state->flags = 0;
-	if (valE == 0) {
-		state->flags |= 0x40;
-	}
-	if (valE < 0) {
-		state->flags |= 0x04;
-	}
+	set_cc(valE);
 	return 1;
 }
 
 int y86_instruction_handler::subq() {
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
 	int64_t valA = (int64_t) state->registers[inst->rA];
 	int64_t valB = (int64_t) state->registers[inst->rB];
 	
 	int64_t valE = valB - valA;
 	state->registers[inst->rB] = valE;
 
-	state->flags = 0;
-	if (valE == 0) {
-		state->flags |= 0x40;
-	}
-	if (valE < 0) {
-		state->flags |= 0x04;
-	}
+	set_cc(valE);
 	return 1;
 }
 
 int y86_instruction_handler::mulq() {
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
 	int64_t valA = (int64_t) state->registers[inst->rA];
 	int64_t valB = (int64_t) state->registers[inst->rB];
 	
 	int64_t valE = valB * valA;
 	state->registers[inst->rB] = valE;
 
-	state->flags = 0;
-	if (valE == 0) {
-		state->flags |= 0x40;
-	}
-	if (valE < 0) {
-		state->flags |= 0x04;
-	}
+	set_cc(valE);
 	return 1;
 }
 
 int y86_instruction_handler::xorq() {
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
 	int64_t valA = (int64_t) state->registers[inst->rA];
 	int64_t valB = (int64_t) state->registers[inst->rB];
 	
 	int64_t valE = valB ^ valA;
 	state->registers[inst->rB] = valE;
 
-	state->flags = 0;
-	if (valE == 0) {
-		state->flags |= 0x40;
-	}
-	if (valE < 0) {
-		state->flags |= 0x04;
-	}
+	set_cc(valE);
 	return 1;
 }
 
 int y86_instruction_handler::andq() {
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
 	int64_t valA = (int64_t) state->registers[inst->rA];
 	int64_t valB = (int64_t) state->registers[inst->rB];
 	
 	int64_t valE = valB & valA;
 	state->registers[inst->rB] = valE;
 
-	state->flags = 0;
-	if (valE == 0) {
-		state->flags |= 0x40;
-	}
-	if (valE < 0) {
-		state->flags |= 0x04;
-	}
+	set_cc(valE);
 	return 1;
 }
 
 int y86_instruction_handler::divq() {
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
 	int64_t valA = (int64_t) state->registers[inst->rA];
 	int64_t valB = (int64_t) state->registers[inst->rB];
 
@@ -429,24 +683,16 @@ int y86_instruction_handler::divq() {
 	int64_t valE = valB / valA;
 	state->registers[inst->rB] = valE;
 
-	state->flags = 0;
-	if (valE == 0) {
-		state->flags |= 0x40;
-	}
-	if (valE < 0) {
-		state->flags |= 0x04;
-	}
+	set_cc(valE);
 	return 1;
 }
 
 int y86_instruction_handler::modq() {
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
 	int64_t valA = (int64_t) state->registers[inst->rA];
 	int64_t valB = (int64_t) state->registers[inst->rB];
 
 	if ((valA == 0) && (valB == 0)) {
+		state->cc_pending = 0;
 		state->flags = 0x40;
 		return 0;
 	}
@@ -457,49 +703,40 @@ int y86_instruction_handler::modq() {
 	int64_t valE = valB % valA;
 	state->registers[inst->rB] = valE;
 
-	state->flags = 0;
-	if (valE == 0) {
-		state->flags |= 0x40;
-	}
-	if (valE < 0) {
-		state->flags |= 0x04;
-	}
+	set_cc(valE);
 	return 1;
 }
 
 int y86_instruction_handler::cmov(int cc) {
-	// Validate Registers
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
+	uint8_t flags = get_flags();
 	switch (cc) {
 		case 1:
-			if ((state->flags == FLAG_Z) || (state->flags == FLAG_S)) {
+			if ((flags == FLAG_Z) || (flags == FLAG_S)) {
 				state->registers[(int) inst->rB] = state->registers[(int) inst->rA];
 			}
 			break;
 		case 2:
-			if ((state->flags == FLAG_S) && (state->flags != FLAG_Z)) {
+			if ((flags == FLAG_S) && (flags != FLAG_Z)) {
 				state->registers[(int) inst->rB] = state->registers[(int) inst->rA];
 			}
 			break;
 		case 3:
-			if ((state->flags == FLAG_Z) && (state->flags != FLAG_S)) {
+			if ((flags == FLAG_Z) && (flags != FLAG_S)) {
 				state->registers[(int) inst->rB] = state->registers[(int) inst->rA];
 			}
 			break;
 		case 4:
-			if (state->flags != FLAG_Z) {
+			if (flags != FLAG_Z) {
 				state->registers[(int) inst->rB] = state->registers[(int) inst->rA];
 			}
 			break;
 		case 5:
-			if ((state->flags == FLAG_Z) || (state->flags != FLAG_S)) {
+			if ((flags == FLAG_Z) || (flags != FLAG_S)) {
 				state->registers[(int) inst->rB] = state->registers[(int) inst->rA];
 			}
 			break;
 		case 6:
-			if ((state->flags != FLAG_S) && (state->flags != FLAG_Z)) {
+			if ((flags != FLAG_S) && (flags != FLAG_Z)) {
 				state->registers[(int) inst->rB] = state->registers[(int) inst->rA];
 			}
 			break;
@@ -510,36 +747,35 @@ int y86_instruction_handler::cmov(int cc) {
 }
 
 int y86_instruction_handler::jmpCond(int cc) {
-
+	uint8_t flags = get_flags();
 	switch (cc) {
 		case 1:
-			if ((state->flags == FLAG_Z) || (state->flags == FLAG_S)) {
+			if ((flags == FLAG_Z) || (flags == FLAG_S)) {
 				state->pc = inst->constval;
 			}
 			break;
 		case 2:
-			// printf("Flags: %x\n", state->flags);
-			if ((state->flags == FLAG_S) && (state->flags != FLAG_Z)) {
+			if ((flags == FLAG_S) && (flags != FLAG_Z)) {
 				state->pc = inst->constval;
 			}
 			break;
 		case 3:
-			if ((state->flags == FLAG_Z) && (state->flags != FLAG_S)) {
+			if ((flags == FLAG_Z) && (flags != FLAG_S)) {
 				state->pc = inst->constval;
 			}
 			break;
 		case 4:
-			if (state->flags != FLAG_Z) {
+			if (flags != FLAG_Z) {
 				state->pc = inst->constval;
 			}
 			break;
 		case 5:
-			if ((state->flags == FLAG_Z) || (state->flags != FLAG_S)) {
+			if ((flags == FLAG_Z) || (flags != FLAG_S)) {
 				state->pc = inst->constval;
 			}
 			break;
 		case 6:
-			if ((state->flags != FLAG_S) && (state->flags != FLAG_Z)) {
+			if ((flags != FLAG_S) && (flags != FLAG_Z)) {
 				state->pc = inst->constval;
 			}
 			break;
@@ -553,9 +789,6 @@ int y86_instruction_handler::jmpCond(int cc) {
 }
 
 int y86_instruction_handler::rmmovq(){
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
 	uint64_t valA = (uint64_t) state->registers[inst->rA];
 	uint64_t valB = (uint64_t) state->registers[inst->rB];
 
@@ -566,9 +799,6 @@ int y86_instruction_handler::rmmovq(){
 }
 
 int y86_instruction_handler::mrmovq(){
-	if (inst->rA < 0x0 || inst->rA >= 0xf || inst->rB < 0x0 || inst->rB >= 0xf) {
-		return 0;
-	}
 	uint64_t valB = (uint64_t) state->registers[inst->rB];
 
 	if(!read_quad(valB + inst->constval, state->registers + inst->rA)) {
@@ -578,9 +808,6 @@ int y86_instruction_handler::mrmovq(){
 }
 
 int y86_instruction_handler::pushq() {
-	if (inst->rA < 0x0 || inst->rA >= 0xf) {
-		return 0;
-	}
 	uint64_t valA = (uint64_t) state->registers[inst->rA];
 	uint64_t valRSP = (uint64_t) state->registers[4];
 	if (valRSP < 8) {
@@ -594,9 +821,6 @@ int y86_instruction_handler::pushq() {
 }
 
 int y86_instruction_handler::popq() {
-	if (inst->rA < 0x0 || inst->rA >= 0xf) {
-		return 0;
-	}
 	uint64_t valRSP = (uint64_t) state->registers[4];
 	if (valRSP < 0) {
 		return 0;
@@ -635,6 +859,53 @@ int y86_instruction_handler::ret() {
 	return 1;
 }
 
+// Bulk memory extension: %rcx holds the length in bytes. The whole range is
+// checked once, then the C library's vectorized routines do the work.
+
+// bcopy rA rB: copy %rcx bytes from address rA to address rB; the ranges may overlap
+int y86_instruction_handler::bcopy() {
+	uint64_t len = state->registers[1];
+	uint64_t dest = state->registers[inst->rB];
+	const uint8_t* src = memory_range(state->registers[inst->rA], len);
+	uint8_t* dst = memory_range(dest, len);
+	if (!src || !dst) {
+		return 0;
+	}
+	memmove(dst, src, len);
+	if (watch_pages && len) {
+		check_watch(dest, len);
+	}
+	return 1;
+}
+
+// bfill rA rB: set %rcx bytes from address rB to the low byte of rA
+int y86_instruction_handler::bfill() {
+	uint64_t len = state->registers[1];
+	uint64_t dest = state->registers[inst->rB];
+	uint8_t* dst = memory_range(dest, len);
+	if (!dst) {
+		return 0;
+	}
+	memset(dst, (uint8_t) state->registers[inst->rA], len);
+	if (watch_pages && len) {
+		check_watch(dest, len);
+	}
+	return 1;
+}
+
+// bcmp rA rB: compare %rcx bytes at rB with those at rA, setting the
+// condition codes the way subq does for rB - rA
+int y86_instruction_handler::bcmp() {
+	uint64_t len = state->registers[1];
+	const uint8_t* a = memory_range(state->registers[inst->rA], len);
+	const uint8_t* b = memory_range(state->registers[inst->rB], len);
+	if (!a || !b) {
+		return 0;
+	}
+	set_cc(memcmp(b, a, len));
+	return 1;
+}
+
 inst_t y86_instruction_handler::inst_to_enum(char* str) {
     for (int i = 0; i < sizeof(cmd_map)/sizeof(cmd_map[0]); i++) {
 		if (strcmp(str, cmd_map[i].cmd_str) == 0) {
@@ -644,137 +915,519 @@ inst_t y86_instruction_handler::inst_to_enum(char* str) {
 	return I_INVALID;
 }
 
-string y86_instruction_handler::handle_instruction(string& instruction) {
-    stringstream ss;
-    if (instruction == "dump") {
-        return dump_state();
+stop_t y86_instruction_handler::step() {
+    int ok = 1;
+
+    if (!inst->valid) {
+        return STOP_ERROR;
     }
-    try {
-        convert_to_inst(instruction);
-        if (!inst) {
-            throw runtime_error("Instruction not created");
+    switch (inst->op) {
+        case I_HALT:
+            return STOP_HALT;
+        case I_IRMOVQ:
+            ok = irmovq();
+            break;
+        case I_RRMOVQ:
+            ok = rrmovq();
+            break;
+        case I_ADDQ:
+            ok = addq();
+            break;
+        case I_SUBQ:
+            ok = subq();
+            break;
+        case I_MULQ:
+            ok = mulq();
+            break;
+        case I_XORQ:
+            ok = xorq();
+            break;
+        case I_ANDQ:
+            ok = andq();
+            break;
+        case I_DIVQ:
+            ok = divq();
+            break;
+        case I_MODQ:
+            ok = modq();
+            break;
+        case I_CMOVLE:
+            ok = cmov(1);
+            break;
+        case I_CMOVL:
+            ok = cmov(2);
+            break;
+        case I_CMOVEQ:
+            ok = cmov(3);
+            break;
+        case I_CMOVNE:
+            ok = cmov(4);
+            break;
+        case I_CMOVGE:
+            ok = cmov(5);
+            break;
+        case I_CMOVG:
+            ok = cmov(6);
+            break;
+        case I_JLE:
+            ok = jmpCond(1);
+            break;
+        case I_JL:
+            ok = jmpCond(2);
+            break;
+        case I_JEQ:
+            ok = jmpCond(3);
+            break;
+        case I_JNE:
+            ok = jmpCond(4);
+            break;
+        case I_JGE:
+            ok = jmpCond(5);
+            break;
+        case I_JG:
+            ok = jmpCond(6);
+            break;
+        case I_RMMOVQ:
+            ok = rmmovq();
+            break;
+        case I_MRMOVQ:
+            ok = mrmovq();
+            break;
+        case I_PUSHQ:
+            ok = pushq();
+            break;
+        case I_POPQ:
+            ok = popq();
+            break;
+        case I_CALL:
+            ok = call();
+            break;
+        case I_RET:
+            ok = ret();
+            break;
+        case I_BCOPY:
+            ok = bulk_isa && bcopy();
+            break;
+        case I_BFILL:
+            ok = bulk_isa && bfill();
+            break;
+        case I_BCMP:
+            ok = bulk_isa && bcmp();
+            break;
+        default:
+            break;
+    }
+    if (!ok) {
+        return STOP_ERROR;
+    }
+    update_PC();
+    return STOP_NONE;
+}
+
+string y86_instruction_handler::load_program(const string& text) {
+    vector<y86_inst> loaded;
+    vector<int32_t> offsets;
+
+    // A program seen before by any session is copied out already decoded
+    if (!cache || !cache->lookup(text, loaded, offsets)) {
+        size_t start = 0;
+
+        // Instructions are separated by ';' and laid out from the current PC
+        while (start <= text.size()) {
+            size_t end = text.find(';', start);
+            if (end == string::npos) {
+                end = text.size();
+            }
+            string piece = text.substr(start, end - start);
+            start = end + 1;
+            if (split(piece).empty()) {
+                continue;
+            }
+            convert_to_inst(piece);
+            decode(*parsed);
+            loaded.push_back(*parsed);
         }
-    } catch (const exception& e) {
-        return string("Error: ") + e.what(); // Handle error
+        if (loaded.empty()) {
+            throw invalid_argument("Empty program");
+        }
+        layout_program(loaded, offsets);
+        if (cache) {
+            cache->insert(text, loaded, offsets);
+        }
+    }
+    if (memory_budget && sizeof(y86_state) + loaded.size() * sizeof(y86_inst) +
+        offsets.size() * sizeof(int32_t) > memory_budget) {
+        throw invalid_argument("Program exceeds memory budget");
     }
+    install_program(loaded, offsets);
+
+    stringstream ss;
+    ss << "Program Loaded: " << dec << program.size() << " instructions at 0x"
+       << hex << setw(16) << setfill('0') << state->pc;
+    return ss.str();
+}
 
-    inst_t enum_inst = inst_to_enum(inst->instruction);
+void y86_instruction_handler::install_program(vector<y86_inst>& loaded, vector<int32_t>& offsets) {
+    program.swap(loaded);
+    prog_offsets.swap(offsets);
+    prog_base = state->pc;
 
-    if (enum_inst == I_INVALID) {
+    if (log) {
+        string payload;
+        for (const y86_inst& rec : program) {
+            pack_inst(rec, payload);
+        }
+        log_record(LOG_LOAD, payload);
+        log_done();
+    }
+}
+
+string y86_instruction_handler::set_breakpoint(const vector<string>& tokens, bool enable) {
+    if (tokens.size() < 2) {
+        throw invalid_argument("Missing breakpoint address");
+    }
+    uint64_t addr = parse_addr(tokens[1]);
+    if (enable) {
+        breakpoints.insert(addr);
+    } else if (!breakpoints.erase(addr)) {
         return "Error Occured";
     }
-    if (enum_inst == I_HALT) {
-        return "Halt. Program Ended";
+
+    stringstream ss;
+    ss << (enable ? "Breakpoint set at 0x" : "Breakpoint cleared at 0x")
+       << hex << setw(16) << setfill('0') << addr;
+    return ss.str();
+}
+
+string y86_instruction_handler::set_watchpoint(const vector<string>& tokens, bool enable) {
+    if (tokens.size() < 2) {
+        throw invalid_argument("Missing watchpoint address");
     }
-    if (enum_inst == I_IRMOVQ) {
-        if (!irmovq()) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_RRMOVQ) {
-        if (!rrmovq()) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_ADDQ) {
-        if (!addq()) {
+    uint64_t addr = parse_addr(tokens[1]);
+    if (enable) {
+        uint64_t len = tokens.size() > 2 ? parse_addr(tokens[2]) : 8;
+        if (len == 0 || addr < state->start_addr ||
+            addr - state->start_addr >= state->valid_mem ||
+            len > state->valid_mem - (addr - state->start_addr)) {
             return "Error Occured";
         }
-    } else if (enum_inst == I_SUBQ) {
-        if (!subq()) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_MULQ) {
-        if (!mulq()) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_XORQ) {
-        if (!xorq()) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_ANDQ) {
-        if (!andq()) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_DIVQ) {
-        if (!divq()) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_MODQ) {
-        if (!modq()) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_CMOVLE) {
-        if (!cmov(1)) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_CMOVL) {
-        if (!cmov(2)) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_CMOVEQ) {
-        if (!cmov(3)) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_CMOVNE) {
-        if (!cmov(4)) {
-            return "Error Occured";
-        }
-    } else if (enum_inst == I_CMOVGE) {
-        if (!cmov(5)) {
-            return "Error Occured";
+        watchpoints.push_back({addr, len});
+    } else {
+        size_t before = watchpoints.size();
+        for (size_t i = 0; i < watchpoints.size();) {
+            if (watchpoints[i].addr == addr) {
+                watchpoints.erase(watchpoints.begin() + i);
+            } else {
+                i++;
+            }
         }
-    } else if (enum_inst == I_CMOVG) {
-        if (!cmov(6)) {
+        if (watchpoints.size() == before) {
             return "Error Occured";
         }
-    } else if (enum_inst == I_JLE) {
-        if (!jmpCond(1)) {
-            return "Error Occured";
+    }
+    rearm_watch_pages();
+
+    stringstream ss;
+    ss << (enable ? "Watchpoint set at 0x" : "Watchpoint cleared at 0x")
+       << hex << setw(16) << setfill('0') << addr;
+    return ss.str();
+}
+
+bool y86_instruction_handler::program_loaded() {
+    return !program.empty();
+}
+
+// Install another handler's decoded program, laid out from the current PC,
+// and its instruction set without parsing it again. Only reads `from`, so
+// many handlers may share one.
+void y86_instruction_handler::share_program(const y86_instruction_handler& from) {
+    program = from.program;
+    prog_offsets = from.prog_offsets;
+    prog_base = state->pc;
+    bulk_isa = from.bulk_isa;
+}
+
+bool y86_instruction_handler::bulk_isa_enabled() {
+    return bulk_isa;
+}
+
+void y86_instruction_handler::set_memory_budget(size_t bytes) {
+    memory_budget = bytes;
+}
+
+void y86_instruction_handler::set_program_cache(program_cache* shared) {
+    cache = shared;
+}
+
+// Execute up to max_steps loaded instructions (0 for no limit). A resumed
+// run continues an earlier slice, so a breakpoint on its first PC counts.
+stop_t y86_instruction_handler::run(uint64_t max_steps, uint64_t* executed, bool resume) {
+    uint64_t n = 0;
+    stop_t reason = STOP_LIMIT;
+
+    if (log) {
+        string payload((const char*) &max_steps, 8);
+        payload.push_back((char) resume);
+        log_record(LOG_RUN, payload);
+    }
+
+    // A watched write made between runs, by memwrite or a single
+    // instruction, stops this one before it starts
+    if (watch_hit) {
+        watch_hit = false;
+        *executed = 0;
+        log_done();
+        return STOP_WATCH;
+    }
+    while (max_steps == 0 || n < max_steps) {
+        uint64_t offset = state->pc - prog_base;
+        if (offset >= prog_offsets.size() || prog_offsets[offset] < 0) {
+            reason = STOP_NOPROG;
+            break;
         }
-    } else if (enum_inst == I_JL) {
-        if (!jmpCond(2)) {
-            return "Error Occured";
+        // A breakpoint on the starting PC is stepped over so runs can resume
+        if ((n > 0 || resume) && breakpoints.count(state->pc)) {
+            reason = STOP_BREAK;
+            break;
         }
-    } else if (enum_inst == I_JEQ) {
-        if (!jmpCond(3)) {
-            return "Error Occured";
+        inst = &program[prog_offsets[offset]];
+        stop_t result = step();
+        n++;
+        if (result != STOP_NONE) {
+            reason = result;
+            break;
         }
-    } else if (enum_inst == I_JNE) {
-        if (!jmpCond(4)) {
-            return "Error Occured";
+        if (watch_hit) {
+            watch_hit = false;
+            reason = STOP_WATCH;
+            break;
         }
-    } else if (enum_inst == I_JGE) {
-        if (!jmpCond(5)) {
-            return "Error Occured";
+    }
+    *executed = n;
+    log_done();
+    return reason;
+}
+
+string y86_instruction_handler::stop_report(stop_t reason, uint64_t executed) {
+    stringstream ss;
+
+    ss << "Stopped: ";
+    switch (reason) {
+        case STOP_HALT:
+            ss << "Halt";
+            break;
+        case STOP_ERROR:
+            ss << "Error Occured";
+            break;
+        case STOP_BREAK:
+            ss << "Breakpoint at 0x" << hex << setw(16) << setfill('0') << state->pc;
+            break;
+        case STOP_WATCH:
+            ss << "Watchpoint hit writing 0x" << hex << setw(16) << setfill('0') << watch_addr;
+            break;
+        case STOP_NOPROG:
+            ss << "PC 0x" << hex << setw(16) << setfill('0') << state->pc << " outside program";
+            break;
+        case STOP_LIMIT:
+            ss << "Step limit reached";
+            break;
+        case STOP_BUDGET:
+            ss << "Budget exhausted";
+            break;
+        case STOP_DEADLINE:
+            ss << "Deadline exceeded";
+            break;
+        default:
+            break;
+    }
+    ss << " after " << dec << executed << " instructions\n";
+    ss << dump_state();
+    return ss.str();
+}
+
+string y86_instruction_handler::run_until(const vector<string>& tokens) {
+    // Optional step limit; 0 runs until something stops the program
+    uint64_t max_steps = tokens.size() > 1 ? parse_addr(tokens[1]) : 0;
+    uint64_t executed = 0;
+
+    if (program.empty()) {
+        return "Error: No program loaded";
+    }
+    stop_t reason = run(max_steps, &executed);
+    return stop_report(reason, executed);
+}
+
+// isa bulk|standard: enable or disable the bulk memory instructions. Their
+// records decode either way, so cached programs are shared by both.
+string y86_instruction_handler::set_isa(const vector<string>& tokens) {
+    if (tokens.size() < 2 || (tokens[1] != "bulk" && tokens[1] != "standard")) {
+        return "Error: Unknown ISA";
+    }
+    bulk_isa = tokens[1] == "bulk";
+    return "ISA set to " + tokens[1];
+}
+
+string y86_instruction_handler::handle_instruction(string& instruction) {
+    if (instruction == "dump") {
+        return dump_state();
+    }
+    try {
+        // Session commands are handled before instruction decoding
+        vector<string> tokens = split(instruction);
+        if (!tokens.empty()) {
+            if (tokens[0] == "load") {
+                return load_program(instruction.substr(instruction.find("load") + 4));
+            }
+            if (log && (tokens[0] == "break" || tokens[0] == "unbreak" ||
+                        tokens[0] == "watch" || tokens[0] == "unwatch" || tokens[0] == "isa")) {
+                log_record(LOG_CMD, instruction);
+                log_done();
+            }
+            if (tokens[0] == "break") {
+                return set_breakpoint(tokens, true);
+            } else if (tokens[0] == "unbreak") {
+                return set_breakpoint(tokens, false);
+            } else if (tokens[0] == "watch") {
+                return set_watchpoint(tokens, true);
+            } else if (tokens[0] == "unwatch") {
+                return set_watchpoint(tokens, false);
+            } else if (tokens[0] == "run-until") {
+                return run_until(tokens);
+            } else if (tokens[0] == "isa") {
+                return set_isa(tokens);
+            }
         }
-    } else if (enum_inst == I_JG) {
-        if (!jmpCond(6)) {
-            return "Error Occured";
+        convert_to_inst(instruction);
+        if (!parsed) {
+            throw runtime_error("Instruction not created");
         }
-    } else if (enum_inst == I_RMMOVQ) {
-        if (!rmmovq()) {
-            return "Error Occured";
+    } catch (const exception& e) {
+        return string("Error: ") + e.what(); // Handle error
+    }
+
+    decode(*parsed);
+    inst = parsed.get();
+    if (log) {
+        string payload;
+        pack_inst(*parsed, payload);
+        log_record(LOG_INST, payload);
+    }
+    stop_t result = step();
+    log_done();
+    if (result == STOP_HALT) {
+        return "Halt. Program Ended";
+    }
+    if (result == STOP_ERROR) {
+        return "Error Occured";
+    }
+    return "Instruction Executed";
+}
+
+int y86_instruction_handler::set_register(uint8_t reg, uint64_t value) {
+    if (reg >= 0xf) {
+        return 0;
+    }
+    state->registers[reg] = value;
+    return 1;
+}
+
+void y86_instruction_handler::set_pc(uint64_t pc) {
+    state->pc = pc;
+}
+
+void y86_instruction_handler::set_replay_log(unique_ptr<replay_log> writer) {
+    log = move(writer);
+}
+
+void y86_instruction_handler::log_record(uint8_t kind, const string& payload) {
+    log->record(kind, payload.data(), payload.size());
+}
+
+// End of a logged request: append a state checksum once enough requests
+// have been logged, and write the request out
+void y86_instruction_handler::log_done() {
+    if (!log) {
+        return;
+    }
+    if (log->checksum_due()) {
+        log->checksum(state_checksum());
+    }
+    log->flush();
+}
+
+uint64_t y86_instruction_handler::state_checksum() {
+    uint8_t flags = get_flags();
+    uint64_t hash = fnv1a_hash(state->memory, sizeof(state->memory));
+    hash = fnv1a_hash(state->registers, sizeof(state->registers), hash);
+    hash = fnv1a_hash(&state->pc, sizeof(state->pc), hash);
+    hash = fnv1a_hash(&state->start_addr, sizeof(state->start_addr), hash);
+    hash = fnv1a_hash(&state->valid_mem, sizeof(state->valid_mem), hash);
+    return fnv1a_hash(&flags, sizeof(flags), hash);
+}
+
+// Re-execute one logged request. Returns 0 if a checksum record does not
+// match the replayed state, 1 otherwise.
+int y86_instruction_handler::replay_record(uint8_t kind, const string& payload, uint64_t* executed) {
+    *executed = 0;
+    switch (kind) {
+        case LOG_INST: {
+            if (payload.size() != LOG_INST_SIZE) {
+                throw invalid_argument("Malformed instruction record");
+            }
+            y86_inst rec = unpack_inst(payload.data());
+            validate(rec);
+            inst = &rec;
+            step();
+            *executed = 1;
+            break;
         }
-    } else if (enum_inst == I_MRMOVQ) {
-        if (!mrmovq()) {
-            return "Error Occured";
+        case LOG_LOAD: {
+            if (payload.empty() || payload.size() % LOG_INST_SIZE != 0) {
+                throw invalid_argument("Malformed load record");
+            }
+            vector<y86_inst> loaded;
+            vector<int32_t> offsets;
+            for (size_t off = 0; off < payload.size(); off += LOG_INST_SIZE) {
+                loaded.push_back(unpack_inst(payload.data() + off));
+                validate(loaded.back());
+            }
+            layout_program(loaded, offsets);
+            install_program(loaded, offsets);
+            break;
         }
-    } else if (enum_inst == I_PUSHQ) {
-        if (!pushq()) {
-            return "Error Occured";
+        case LOG_RUN: {
+            if (payload.size() != 9) {
+                throw invalid_argument("Malformed run record");
+            }
+            uint64_t max_steps;
+            memcpy(&max_steps, payload.data(), 8);
+            run(max_steps, executed, payload[8] != 0);
+            break;
         }
-    } else if (enum_inst == I_POPQ) {
-        if (!popq()) {
-            return "Error Occured";
+        case LOG_MEMWRITE: {
+            if (payload.size() < 8) {
+                throw invalid_argument("Malformed memwrite record");
+            }
+            uint64_t address;
+            memcpy(&address, payload.data(), 8);
+            write_memory(address, (const uint8_t*) payload.data() + 8, payload.size() - 8);
+            break;
         }
-    } else if (enum_inst == I_CALL) {
-        if (!call()) {
-            return "Error Occured";
+        case LOG_CMD: {
+            string command = payload;
+            handle_instruction(command);
+            break;
         }
-    } else if (enum_inst == I_RET) {
-        if (!ret()) {
-            return "Error Occured";
+        case LOG_CHECKSUM: {
+            if (payload.size() != 8) {
+                throw invalid_argument("Malformed checksum record");
+            }
+            uint64_t sum;
+            memcpy(&sum, payload.data(), 8);
+            return sum == state_checksum();
         }
+        default:
+            throw invalid_argument("Unknown record kind");
     }
-    update_PC();
-    return "Instruction Executed";
+    return 1;
 }
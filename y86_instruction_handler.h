@@ -9,6 +9,7 @@
 #include <stdexcept>
 #include <sstream>
 #include <vector>
+#include <unordered_set>
 
 using namespace std;
 
@@ -16,6 +17,9 @@ using namespace std;
 #define FLAG_Z 0x40
 #define FLAG_S 0x04
 
+// Watchpoints are armed per 64-byte page of state->memory
+#define WATCH_PAGE_SHIFT 6
+
 struct y86_state {
     uint8_t memory[1024];
     uint64_t start_addr;
@@ -23,10 +27,14 @@ struct y86_state {
     uint64_t registers[16];
     uint64_t pc;
     uint8_t flags; 
+    // Condition codes are evaluated lazily: ALU ops only record their
+    // result, and flags is recomputed from it when someone reads it
+    uint8_t cc_pending;
+    int64_t cc_result;
 
     // Constructor
     y86_state(const uint8_t mem[], uint64_t start_addr, uint64_t valid_mem, const uint64_t registers[], uint64_t pc, uint8_t flags) 
-        : start_addr(start_addr), valid_mem(valid_mem), pc(pc), flags(flags) {
+        : start_addr(start_addr), valid_mem(valid_mem), pc(pc), flags(flags), cc_pending(0), cc_result(0) {
         // Copy memory array
         std::memcpy(this->memory, mem, sizeof(this->memory));
         // Copy registers array
@@ -34,22 +42,6 @@ struct y86_state {
     }
 };
 
-struct y86_inst {
-    uint8_t rA;
-    uint8_t rB;
-    uint64_t constval;
-    char instruction[10];
-
-    // Constructor
-    y86_inst(uint8_t rA, uint8_t rB, uint64_t constval, const char* instruction) 
-        : rA(rA), rB(rB), constval(constval) {
-        // Copy instruction string, ensuring null-termination
-        strncpy(this->instruction, instruction, sizeof(this->instruction) - 1);
-        // Null-terminate the string in case of overflow
-        this->instruction[sizeof(this->instruction) - 1] = '\0';
-    }
-};
-
 enum inst_t {
     I_NOP,
     I_HALT,
@@ -81,18 +73,86 @@ enum inst_t {
     I_CMOVLE,
     I_CMOVG,
     I_CMOVGE,
-    I_INVALID
+    I_INVALID,
+    // Bulk memory extension, only executed after `isa bulk`. Appended so the
+    // op numbers in existing replay logs keep their meaning.
+    I_BCOPY,
+    I_BFILL,
+    I_BCMP
 };
 
+struct y86_inst {
+    uint8_t rA;
+    uint8_t rB;
+    uint64_t constval;
+    char instruction[10];
+    inst_t op;      // Set by decode()
+    uint8_t valid;  // Registers checked by decode(); handlers trust this record
+
+    // Constructor
+    y86_inst(uint8_t rA, uint8_t rB, uint64_t constval, const char* instruction) 
+        : rA(rA), rB(rB), constval(constval), op(I_INVALID), valid(0) {
+        // Copy instruction string, ensuring null-termination
+        strncpy(this->instruction, instruction, sizeof(this->instruction) - 1);
+        // Null-terminate the string in case of overflow
+        this->instruction[sizeof(this->instruction) - 1] = '\0';
+    }
+};
+
+
+// Reason a server-side run stopped
+enum stop_t {
+    STOP_NONE,
+    STOP_HALT,
+    STOP_ERROR,
+    STOP_BREAK,
+    STOP_WATCH,
+    STOP_NOPROG,
+    STOP_LIMIT,
+    STOP_BUDGET,
+    STOP_DEADLINE
+};
+
+struct y86_watch {
+    uint64_t addr;
+    uint64_t len;
+};
+
+class program_cache;
+class replay_log;
+
 class y86_instruction_handler {
     private:
         unique_ptr<y86_state> state; // Use smart pointer for state
-        unique_ptr<y86_inst> inst;   // Use smart pointer for inst
+        unique_ptr<y86_inst> parsed; // Last single-step instruction parsed
+        const y86_inst* inst;        // Decoded record being executed
+        vector<y86_inst> program;    // Loaded program, in address order
+        uint64_t prog_base;          // Address of the first loaded instruction
+        vector<int32_t> prog_offsets; // pc - prog_base -> index into program, -1 mid-instruction
+        unordered_set<uint64_t> breakpoints;
+        vector<y86_watch> watchpoints;
+        uint64_t watch_pages;        // Bit i set if page i has an armed watchpoint
+        bool watch_hit;
+        uint64_t watch_addr;
+        bool bulk_isa;               // Bulk memory extension enabled
+        size_t memory_budget;        // Max bytes of state plus program, 0 for no limit
+        static program_cache* cache; // Shared decoded programs, may be null
+        unique_ptr<replay_log> log;  // Record of this session's requests, may be null
         inst_t inst_to_enum(char* str);
         void convert_to_inst(string& instruction);
+        void decode(y86_inst& rec);
+        void validate(y86_inst& rec);
+        void install_program(vector<y86_inst>& loaded, vector<int32_t>& offsets);
+        void log_record(uint8_t kind, const string& payload);
+        void log_done();
         int read_quad(uint64_t address, uint64_t* value);
         int write_quad(uint64_t address, uint64_t value);
+        uint8_t* memory_range(uint64_t address, uint64_t len);
+        void check_watch(uint64_t address, uint64_t len = 8);
+        void rearm_watch_pages();
         void update_PC();
+        void set_cc(int64_t valE);
+        uint8_t get_flags();
         int irmovq();
         int rrmovq();
         int rmmovq();
@@ -110,11 +170,41 @@ class y86_instruction_handler {
         int popq();
         int call();
         int ret();
+        int bcopy();
+        int bfill();
+        int bcmp();
         string dump_state();
+        stop_t step();
+        string load_program(const string& text);
+        string set_breakpoint(const vector<string>& tokens, bool enable);
+        string set_watchpoint(const vector<string>& tokens, bool enable);
+        string run_until(const vector<string>& tokens);
+        string set_isa(const vector<string>& tokens);
 
     public:
         y86_instruction_handler();
+        ~y86_instruction_handler();
+        void reset();
+        string save_state();
+        void restore_state(const string& saved);
+        void release_state();
+        bool hibernated();
+        size_t resident_bytes();
         string handle_instruction(string& instruction);
+        stop_t run(uint64_t max_steps, uint64_t* executed, bool resume = false);
+        string stop_report(stop_t reason, uint64_t executed);
+        bool program_loaded();
+        void share_program(const y86_instruction_handler& from);
+        bool bulk_isa_enabled();
+        void set_memory_budget(size_t bytes);
+        static void set_program_cache(program_cache* shared);
+        const uint8_t* read_memory(uint64_t address, uint64_t len);
+        int write_memory(uint64_t address, const uint8_t* data, uint64_t len);
+        int set_register(uint8_t reg, uint64_t value);
+        void set_pc(uint64_t pc);
+        void set_replay_log(unique_ptr<replay_log> writer);
+        uint64_t state_checksum();
+        int replay_record(uint8_t kind, const string& payload, uint64_t* executed);
 };
 
 #endif // Y86_INSTRUCTION_HANDLER_H
@@ -0,0 +1,60 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include "y86_instruction_handler.h"
+#include "replay_log.h"
+
+using namespace std;
+
+// Re-execute one session log against a fresh handler, checking every
+// checksum record. Returns true if the replay matched throughout.
+static bool replay_file(const string& path) {
+    y86_instruction_handler handler;
+    uint64_t records = 0, instructions = 0, checksums = 0;
+    uint8_t kind;
+    string payload;
+
+    try {
+        replay_reader reader(path);
+        auto start = chrono::steady_clock::now();
+        while (reader.next(kind, payload)) {
+            uint64_t executed = 0;
+            records++;
+            if (!handler.replay_record(kind, payload, &executed)) {
+                cout << path << ": MISMATCH at record " << records << endl;
+                return false;
+            }
+            if (kind == LOG_CHECKSUM) {
+                checksums++;
+            }
+            instructions += executed;
+        }
+        auto end = chrono::steady_clock::now();
+        double secs = chrono::duration<double>(end - start).count();
+
+        cout << path << ": OK, " << records << " records, " << checksums << " checksums, "
+             << instructions << " instructions in " << secs << " s";
+        if (secs > 0) {
+            cout << " (" << (instructions / secs) / 1e6 << " M inst/s)";
+        }
+        cout << endl;
+    } catch (const exception& e) {
+        cout << path << ": Error: " << e.what() << " at record " << records << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <log>..." << endl;
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!replay_file(argv[i])) {
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
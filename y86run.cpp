@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+#include "y86_instruction_handler.h"
+#include "program_cache.h"
+#include "y86_batch.h"
+
+using namespace std;
+
+struct run_config {
+    unsigned threads;
+    uint64_t max_steps;
+    string out_dir;         // Empty to print every report to stdout
+    size_t cache_size;
+    bool bulk_isa;          // Programs may use the bulk memory instructions
+};
+
+static bool read_file(const string& path, string& out) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+        return false;
+    }
+    stringstream ss;
+    ss << in.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+static string base_name(const string& path) {
+    size_t slash = path.rfind('/');
+    string name = slash == string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.rfind('.');
+    return dot == string::npos || dot == 0 ? name : name.substr(0, dot);
+}
+
+// A directory holds <name>.ys programs, each with an optional <name>.init
+static void load_directory(const string& dir, vector<batch_job>& jobs) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        throw runtime_error("Failed to open directory " + dir);
+    }
+    vector<string> names;
+    while (dirent* entry = readdir(d)) {
+        string name = entry->d_name;
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, ".ys") == 0) {
+            names.push_back(name.substr(0, name.size() - 3));
+        }
+    }
+    closedir(d);
+    sort(names.begin(), names.end());
+
+    for (const string& name : names) {
+        batch_job job;
+        job.name = name;
+        if (!read_file(dir + "/" + name + ".ys", job.program)) {
+            throw runtime_error("Failed to read " + name + ".ys");
+        }
+        read_file(dir + "/" + name + ".init", job.init);
+        jobs.push_back(move(job));
+    }
+}
+
+// Each manifest line is a program path followed by its initial state, e.g.
+// "tests/sum.ys r1=5 m[0x100]=7". Paths are relative to the manifest. The
+// same program usually appears on several lines, so each result is named
+// after its program and line number, e.g. "sum.3".
+static void load_manifest(const string& path, vector<batch_job>& jobs) {
+    ifstream in(path);
+    if (!in) {
+        throw runtime_error("Failed to open manifest " + path);
+    }
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "" : path.substr(0, slash + 1);
+    string line;
+    size_t line_no = 0;
+
+    while (getline(in, line)) {
+        line_no++;
+        stringstream ss(line);
+        string program;
+        if (!(ss >> program) || program[0] == '#') {
+            continue;
+        }
+        batch_job job;
+        job.name = base_name(program) + "." + to_string(line_no);
+        string file = program[0] == '/' ? program : dir + program;
+        if (!read_file(file, job.program)) {
+            throw runtime_error("Failed to read " + file);
+        }
+        getline(ss, job.init);
+        jobs.push_back(move(job));
+    }
+}
+
+static bool write_result(const run_config& config, const batch_result& result) {
+    ofstream out(config.out_dir + "/" + result.name + ".out");
+    out << result.report;
+    return (bool) out;
+}
+
+static void usage(const char* prog) {
+    cerr << "Usage: " << prog << " [options] <directory|manifest>" << endl
+         << "  -j <threads>         Worker threads (default: number of cores)" << endl
+         << "  -o <directory>       Write <name>.out per run instead of printing" << endl
+         << "  --max-steps <n>      Per-program instruction limit, 0 for none (default: 100000000)" << endl
+         << "  --cache-size <bytes> Decoded program cache size, 0 to disable (default: 8388608)" << endl
+         << "  --bulk-isa           Enable the bcopy/bfill/bcmp instructions" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    run_config config{thread::hardware_concurrency(), 100000000, "", 8 << 20, false};
+    string input;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 < argc && arg == "-j") {
+            config.threads = strtoul(argv[++i], nullptr, 10);
+        } else if (i + 1 < argc && arg == "-o") {
+            config.out_dir = argv[++i];
+        } else if (i + 1 < argc && arg == "--max-steps") {
+            config.max_steps = strtoull(argv[++i], nullptr, 10);
+        } else if (i + 1 < argc && arg == "--cache-size") {
+            config.cache_size = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--bulk-isa") {
+            config.bulk_isa = true;
+        } else if (input.empty() && arg[0] != '-') {
+            input = arg;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (input.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (config.threads == 0) {
+        config.threads = 1;
+    }
+
+    vector<batch_job> jobs;
+    unique_ptr<program_cache> cache;
+    try {
+        struct stat st;
+        if (stat(input.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            load_directory(input, jobs);
+        } else {
+            load_manifest(input, jobs);
+        }
+        // Programs repeated with different initial states decode only once
+        if (config.cache_size) {
+            cache = make_unique<program_cache>(config.cache_size, 64 * 1024);
+            y86_instruction_handler::set_program_cache(cache.get());
+        }
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+    if (!config.out_dir.empty()) {
+        mkdir(config.out_dir.c_str(), 0755);
+    }
+
+    // Workers claim jobs in order; each reuses one handler for all its jobs
+    vector<batch_result> results(jobs.size());
+    atomic<size_t> next(0);
+    atomic<uint64_t> total_insts(0);
+    atomic<size_t> write_errors(0);
+    auto start = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    for (unsigned t = 0; t < min<size_t>(config.threads, max<size_t>(jobs.size(), 1)); t++) {
+        workers.emplace_back([&]() {
+            y86_instruction_handler handler;
+            if (config.bulk_isa) {
+                string isa = "isa bulk";
+                handler.handle_instruction(isa);
+            }
+            uint64_t insts = 0;
+            for (size_t i = next++; i < jobs.size(); i = next++) {
+                results[i] = run_job(handler, jobs[i], config.max_steps);
+                insts += results[i].executed;
+                if (!config.out_dir.empty()) {
+                    if (!write_result(config, results[i])) {
+                        write_errors++;
+                    }
+                    results[i].report.clear();
+                }
+            }
+            total_insts += insts;
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    auto end = chrono::steady_clock::now();
+    double secs = chrono::duration<double>(end - start).count();
+
+    size_t halted = 0;
+    for (const batch_result& result : results) {
+        if (result.reason == STOP_HALT) {
+            halted++;
+        }
+        if (config.out_dir.empty()) {
+            cout << "== " << result.name << " ==\n" << result.report;
+        }
+    }
+    cerr << jobs.size() << " programs (" << halted << " halted), " << total_insts
+         << " instructions in " << secs << " s on " << workers.size() << " threads";
+    if (secs > 0) {
+        cerr << " (" << jobs.size() / secs << " programs/s, "
+             << (total_insts / secs) / 1e6 << " M inst/s)";
+    }
+    cerr << endl;
+    if (write_errors) {
+        cerr << "Error: failed to write " << write_errors << " result files" << endl;
+        return 1;
+    }
+    return 0;
+}